@@ -0,0 +1,761 @@
+/*
+ * Userspace selftest of the vinput modules. Run as root with vinput_mod,
+ * vkbd_mod, vmouse_mod and vts_mt_mod loaded:
+ *   vinput_test		check every format against the evdev events
+ *   vinput_test -b N	then time N frames (rounded up to even) of each
+ *			format, in ns/event
+ * The devices it exports are unexported on exit. Exits with 0 when all the
+ * checks pass, 1 otherwise and 4 when vinput is not there.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+#include "vinput_uapi.h"
+
+#ifndef input_event_sec
+#define input_event_sec		time.tv_sec
+#define input_event_usec	time.tv_usec
+#endif
+
+#define SYSFS_VINPUT	"/sys/class/vinput"
+#define MAX_IDS		64
+#define MAX_EVENTS	256
+#define SETTLE_MS	100	/* no event for that long ends a read */
+#define TIMED_DELAY_NS	20000000ULL
+#define TIMED_SLACK_NS	1000000ULL
+#define KSFT_SKIP	4
+
+struct expect {
+	unsigned short type;
+	unsigned short code;
+	int value;
+};
+
+static int failures;
+static int exported[MAX_IDS];
+static int nexported;
+
+static void fail(const char *test, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "FAIL %s: ", test);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	failures++;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int sysfs_write(const char *path, const char *val)
+{
+	int fd, err = 0;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, val, strlen(val)) < 0)
+		err = -errno;
+	close(fd);
+
+	return err;
+}
+
+static long sysfs_read_ulong(const char *path)
+{
+	char buf[32] = { 0 };
+	int fd;
+	ssize_t n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	return n > 0 ? strtol(buf, NULL, 10) : -1;
+}
+
+/* ids of the vinputX devices, one flag per id */
+static void scan_ids(char *ids)
+{
+	DIR *dir;
+	int id;
+	char c;
+	struct dirent *ent;
+
+	memset(ids, 0, MAX_IDS);
+	dir = opendir(SYSFS_VINPUT);
+	if (!dir)
+		return;
+	while ((ent = readdir(dir)))
+		if (sscanf(ent->d_name, "vinput%d%c", &id, &c) == 1 &&
+		    id >= 0 && id < MAX_IDS)
+			ids[id] = 1;
+	closedir(dir);
+}
+
+/* export a device, returns its id */
+static int export(const char *spec)
+{
+	int id, err;
+	char before[MAX_IDS], after[MAX_IDS];
+
+	scan_ids(before);
+	err = sysfs_write(SYSFS_VINPUT "/export", spec);
+	if (err) {
+		fprintf(stderr, "export '%s': %s\n", spec, strerror(-err));
+		return err;
+	}
+	scan_ids(after);
+	for (id = 0; id < MAX_IDS; id++) {
+		if (after[id] && !before[id]) {
+			exported[nexported++] = id;
+			return id;
+		}
+	}
+
+	fprintf(stderr, "export '%s': no new device\n", spec);
+	return -ENODEV;
+}
+
+static void unexport_all(void)
+{
+	char val[16];
+
+	while (nexported) {
+		snprintf(val, sizeof(val), "%d", exported[--nexported]);
+		sysfs_write(SYSFS_VINPUT "/unexport", val);
+	}
+	sysfs_write(SYSFS_VINPUT "/sync", "1");
+}
+
+/* udev creates the nodes asynchronously */
+static int open_wait(const char *path, int flags)
+{
+	int fd, i;
+
+	for (i = 0; i < 200; i++) {
+		fd = open(path, flags);
+		if (fd >= 0 || errno != ENOENT)
+			return fd;
+		usleep(10000);
+	}
+
+	return -1;
+}
+
+static int open_vinput(int id)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/dev/vinput%d", id);
+	return open_wait(path, O_RDWR);
+}
+
+/* the evdev node of the input device of vinputX, once registered */
+static int open_evdev(int id)
+{
+	DIR *dir;
+	int fd = -1;
+	int clk = CLOCK_MONOTONIC;
+	char path[PATH_MAX];
+	char input[NAME_MAX + 1] = "", event[NAME_MAX + 1] = "";
+	struct dirent *ent;
+
+	snprintf(path, sizeof(path), SYSFS_VINPUT "/vinput%d", id);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir)))
+		if (!strncmp(ent->d_name, "input", 5))
+			snprintf(input, sizeof(input), "%s", ent->d_name);
+	closedir(dir);
+	if (!*input)
+		return -1;
+
+	snprintf(path, sizeof(path), SYSFS_VINPUT "/vinput%d/%s", id, input);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir)))
+		if (!strncmp(ent->d_name, "event", 5))
+			snprintf(event, sizeof(event), "%s", ent->d_name);
+	closedir(dir);
+	if (!*event)
+		return -1;
+
+	snprintf(path, sizeof(path), "/dev/input/%s", event);
+	fd = open_wait(path, O_RDONLY | O_NONBLOCK);
+	if (fd >= 0)
+		ioctl(fd, EVIOCSCLOCKID, &clk);
+
+	return fd;
+}
+
+/* read the events until none came for SETTLE_MS */
+static int collect(int fd, struct input_event *evs)
+{
+	int n = 0;
+	ssize_t len;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	while (n < MAX_EVENTS && poll(&pfd, 1, SETTLE_MS) > 0) {
+		len = read(fd, &evs[n], (MAX_EVENTS - n) * sizeof(*evs));
+		if (len < 0) {
+			if (errno == EAGAIN)
+				continue;
+			break;
+		}
+		n += len / sizeof(*evs);
+	}
+
+	return n;
+}
+
+/*
+ * The expected events must come in order, others may be interleaved (the
+ * input core filters and adds some, e.g. autorepeat or pointer emulation).
+ * Returns the index of the first event matching want[0].
+ */
+static int match(const char *test, const struct input_event *evs, int n,
+		 const struct expect *want, int nwant)
+{
+	int i, j = 0, first = -1;
+
+	for (i = 0; i < n && j < nwant; i++) {
+		if (evs[i].type == want[j].type &&
+		    evs[i].code == want[j].code &&
+		    evs[i].value == want[j].value) {
+			if (first < 0)
+				first = i;
+			j++;
+		}
+	}
+	if (j < nwant) {
+		fail(test, "missing event %d: type %u code %u value %d, got",
+		     j, want[j].type, want[j].code, want[j].value);
+		for (i = 0; i < n; i++)
+			fprintf(stderr, "\t%u %u %d\n", evs[i].type,
+				evs[i].code, evs[i].value);
+		return -1;
+	}
+
+	return first;
+}
+
+/* a text write and the events it must produce */
+static void check_text(const char *test, int fd, int evfd, const char *text,
+		       const struct expect *want, int nwant)
+{
+	int n;
+	ssize_t ret;
+	struct input_event evs[MAX_EVENTS];
+
+	ret = write(fd, text, strlen(text));
+	if (ret != (ssize_t)strlen(text)) {
+		fail(test, "write '%s': %s", text,
+		     ret < 0 ? strerror(errno) : "short write");
+		return;
+	}
+	n = collect(evfd, evs);
+	match(test, evs, n, want, nwant);
+}
+
+/* a write that must fail with err and produce no event */
+static void check_reject(const char *test, int fd, int evfd, const void *buf,
+			 size_t len, int err)
+{
+	int n;
+	ssize_t ret;
+	struct input_event evs[MAX_EVENTS];
+
+	ret = write(fd, buf, len);
+	if (ret >= 0 || errno != err)
+		fail(test, "write returned %zd (%s), expected %s", ret,
+		     ret < 0 ? strerror(errno) : "no error", strerror(err));
+	n = collect(evfd, evs);
+	if (n)
+		fail(test, "%d events from a rejected write", n);
+}
+
+#define TEXT(t, fd, evfd, s, ...) do {					\
+	const struct expect _w[] = { __VA_ARGS__ };			\
+	check_text(t, fd, evfd, s, _w, sizeof(_w) / sizeof(_w[0]));	\
+} while (0)
+
+#define SYN	{ EV_SYN, SYN_REPORT, 0 }
+
+static void test_vkbd_text(int id)
+{
+	const char *t = "vkbd text";
+	int fd = open_vinput(id), evfd = open_evdev(id);
+
+	if (fd < 0 || evfd < 0) {
+		fail(t, "cannot open vinput%d or its evdev node", id);
+		goto out;
+	}
+
+	TEXT(t, fd, evfd, "+34", { EV_KEY, KEY_G, 1 }, SYN);
+	TEXT(t, fd, evfd, "-34", { EV_KEY, KEY_G, 0 }, SYN);
+	TEXT(t, fd, evfd, "30\n", { EV_KEY, KEY_A, 1 }, SYN);
+	TEXT(t, fd, evfd, "-30\n", { EV_KEY, KEY_A, 0 }, SYN);
+
+	/* kstrtol failures and out of range codes send nothing */
+	check_reject(t, fd, evfd, "abc", 3, EINVAL);
+	check_reject(t, fd, evfd, "+34x", 4, EINVAL);
+	check_reject(t, fd, evfd, "+9999", 5, EINVAL);
+	check_reject(t, fd, evfd, "+767", 4, EINVAL);	/* KEY_MAX */
+out:
+	if (fd >= 0)
+		close(fd);
+	if (evfd >= 0)
+		close(evfd);
+}
+
+static void test_vmouse_text(int id)
+{
+	const char *t = "vmouse text";
+	int fd = open_vinput(id), evfd = open_evdev(id);
+
+	if (fd < 0 || evfd < 0) {
+		fail(t, "cannot open vinput%d or its evdev node", id);
+		goto out;
+	}
+
+	TEXT(t, fd, evfd, "5,-3,1,0",
+	     { EV_REL, REL_X, 5 }, { EV_REL, REL_Y, -3 },
+	     { EV_REL, REL_WHEEL, 1 }, SYN);
+	/* several buttons change in one write */
+	TEXT(t, fd, evfd, "0,0,0,3",
+	     { EV_KEY, BTN_LEFT, 1 }, { EV_KEY, BTN_RIGHT, 1 }, SYN);
+	TEXT(t, fd, evfd, "0,0,0,6",
+	     { EV_KEY, BTN_LEFT, 0 }, { EV_KEY, BTN_MIDDLE, 1 }, SYN);
+	TEXT(t, fd, evfd, "0,0,0,0",
+	     { EV_KEY, BTN_RIGHT, 0 }, { EV_KEY, BTN_MIDDLE, 0 }, SYN);
+
+	check_reject(t, fd, evfd, "1,2", 3, EINVAL);
+out:
+	if (fd >= 0)
+		close(fd);
+	if (evfd >= 0)
+		close(evfd);
+}
+
+static void test_vts_mt_text(int id)
+{
+	const char *t = "vts_mt text";
+	const char *bad = "2,10,10,10;3,20,20,20";
+	struct vinput_info info;
+	int fd = open_vinput(id), evfd = open_evdev(id);
+
+	if (fd < 0 || evfd < 0) {
+		fail(t, "cannot open vinput%d or its evdev node", id);
+		goto out;
+	}
+
+	if (ioctl(fd, VINPUT_IOC_GET_INFO, &info))
+		fail(t, "VINPUT_IOC_GET_INFO: %s", strerror(errno));
+	else if (info.max_x != 1023 || info.max_y != 767 ||
+		 info.max_points != 2 || strcmp(info.type, "vts_mt"))
+		fail(t, "info: %s %dx%d, %d points", info.type, info.max_x,
+		     info.max_y, info.max_points);
+
+	/* a trailing ';' and newline are not slots */
+	TEXT(t, fd, evfd, "1,100,200,50;\n",
+	     { EV_ABS, ABS_MT_TRACKING_ID, 1 },
+	     { EV_ABS, ABS_MT_POSITION_X, 100 },
+	     { EV_ABS, ABS_MT_POSITION_Y, 200 },
+	     { EV_KEY, BTN_TOUCH, 1 }, { EV_ABS, ABS_X, 100 }, SYN);
+
+	/* id 3 finds no slot: the write fails and frees the slot of id 2 */
+	check_reject(t, fd, evfd, bad, strlen(bad), EINVAL);
+	TEXT(t, fd, evfd, "3,40,40,40",
+	     { EV_ABS, ABS_MT_SLOT, 1 }, { EV_ABS, ABS_MT_TRACKING_ID, 3 },
+	     { EV_ABS, ABS_MT_POSITION_X, 40 }, SYN);
+
+	check_reject(t, fd, evfd, "1,2,3", 5, EINVAL);
+
+	TEXT(t, fd, evfd, "1,100,200,0;3,40,40,0;",
+	     { EV_ABS, ABS_MT_SLOT, 0 }, { EV_ABS, ABS_MT_TRACKING_ID, -1 },
+	     { EV_ABS, ABS_MT_SLOT, 1 }, { EV_ABS, ABS_MT_TRACKING_ID, -1 },
+	     { EV_KEY, BTN_TOUCH, 0 }, SYN);
+out:
+	if (fd >= 0)
+		close(fd);
+	if (evfd >= 0)
+		close(evfd);
+}
+
+static void rec(struct vinput_record *r, int id, int type, int code, int value)
+{
+	r->id = id;
+	r->type = type;
+	r->code = code;
+	r->value = value;
+}
+
+/* record format, vkbd going through send_batch and vmouse through the core */
+static void test_record(int kbd, int mouse)
+{
+	const char *t = "record format";
+	int n;
+	struct vinput_info info;
+	struct vinput_record recs[4];
+	struct input_event evs[MAX_EVENTS];
+	int fd = open_vinput(kbd), evfd = open_evdev(kbd);
+	int mfd = open_vinput(mouse), mevfd = open_evdev(mouse);
+	const struct expect kwant[] = {
+		{ EV_KEY, KEY_B, 1 }, SYN, { EV_KEY, KEY_B, 0 }, SYN,
+	};
+	const struct expect mwant[] = {
+		{ EV_REL, REL_X, 7 }, { EV_KEY, BTN_MIDDLE, 1 }, SYN,
+		{ EV_KEY, BTN_MIDDLE, 0 }, SYN,
+	};
+
+	if (fd < 0 || evfd < 0 || mfd < 0 || mevfd < 0) {
+		fail(t, "cannot open the devices or their evdev nodes");
+		goto out;
+	}
+
+	if (ioctl(fd, VINPUT_IOC_GET_INFO, &info))
+		fail(t, "VINPUT_IOC_GET_INFO: %s", strerror(errno));
+	else if (!(info.formats & (1 << VINPUT_FORMAT_RECORD)) ||
+		 !(info.evbit & (1 << EV_KEY)) || (info.evbit & (1 << EV_REL)))
+		fail(t, "info: formats %#x evbit %#llx", info.formats,
+		     (unsigned long long)info.evbit);
+
+	if (ioctl(fd, VINPUT_IOC_SET_FORMAT, VINPUT_FORMAT_RECORD) ||
+	    ioctl(mfd, VINPUT_IOC_SET_FORMAT, VINPUT_FORMAT_RECORD)) {
+		fail(t, "VINPUT_IOC_SET_FORMAT: %s", strerror(errno));
+		goto out;
+	}
+
+	rec(&recs[0], 0, EV_KEY, KEY_B, 1);
+	rec(&recs[1], 0, EV_SYN, SYN_REPORT, 0);
+	rec(&recs[2], 0, EV_KEY, KEY_B, 0);
+	rec(&recs[3], 0, EV_SYN, SYN_REPORT, 0);
+	if (write(fd, recs, sizeof(recs)) != sizeof(recs))
+		fail(t, "vkbd write: %s", strerror(errno));
+	n = collect(evfd, evs);
+	match(t, evs, n, kwant, 4);
+
+	/* the last frame is synced by the core */
+	rec(&recs[0], 0, EV_REL, REL_X, 7);
+	rec(&recs[1], 0, EV_KEY, BTN_MIDDLE, 1);
+	rec(&recs[2], 0, EV_SYN, SYN_REPORT, 0);
+	rec(&recs[3], 0, EV_KEY, BTN_MIDDLE, 0);
+	if (write(mfd, recs, sizeof(recs)) != sizeof(recs))
+		fail(t, "vmouse write: %s", strerror(errno));
+	n = collect(mevfd, evs);
+	match(t, evs, n, mwant, 5);
+
+	/* event types the device does not have */
+	rec(&recs[0], 0, EV_REL, REL_X, 1);
+	check_reject(t, fd, evfd, recs, sizeof(recs[0]), EINVAL);
+	rec(&recs[0], 0, EV_ABS, ABS_X, 1);
+	check_reject(t, mfd, mevfd, recs, sizeof(recs[0]), EINVAL);
+	check_reject(t, mfd, mevfd, recs, sizeof(recs[0]) - 1, EINVAL);
+out:
+	if (fd >= 0)
+		close(fd);
+	if (evfd >= 0)
+		close(evfd);
+	if (mfd >= 0)
+		close(mfd);
+	if (mevfd >= 0)
+		close(mevfd);
+}
+
+/* timed format, played back at the given CLOCK_MONOTONIC times */
+static void test_timed(int id)
+{
+	const char *t = "timed format";
+	int n, first;
+	uint64_t start, time;
+	struct input_event evs[MAX_EVENTS];
+	struct vinput_timed_record trecs[4];
+	int fd = open_vinput(id), evfd = open_evdev(id);
+	const struct expect want[] = {
+		{ EV_REL, REL_X, 5 }, SYN, { EV_REL, REL_X, -5 }, SYN,
+	};
+
+	if (fd < 0 || evfd < 0) {
+		fail(t, "cannot open vinput%d or its evdev node", id);
+		goto out;
+	}
+	if (ioctl(fd, VINPUT_IOC_SET_FORMAT, VINPUT_FORMAT_TIMED)) {
+		fail(t, "VINPUT_IOC_SET_FORMAT: %s", strerror(errno));
+		goto out;
+	}
+
+	memset(trecs, 0, sizeof(trecs));
+	start = now_ns();
+	trecs[0].time = trecs[1].time = start + TIMED_DELAY_NS;
+	trecs[2].time = trecs[3].time = start + 2 * TIMED_DELAY_NS;
+	rec(&trecs[0].rec, 0, EV_REL, REL_X, 5);
+	rec(&trecs[1].rec, 0, EV_SYN, SYN_REPORT, 0);
+	rec(&trecs[2].rec, 0, EV_REL, REL_X, -5);
+	rec(&trecs[3].rec, 0, EV_SYN, SYN_REPORT, 0);
+	if (write(fd, trecs, sizeof(trecs)) != sizeof(trecs))
+		fail(t, "write: %s", strerror(errno));
+	if (fsync(fd))
+		fail(t, "fsync: %s", strerror(errno));
+	if (now_ns() < start + 2 * TIMED_DELAY_NS - TIMED_SLACK_NS)
+		fail(t, "fsync returned before the playback");
+
+	n = collect(evfd, evs);
+	first = match(t, evs, n, want, 4);
+	if (first >= 0) {
+		time = evs[first].input_event_sec * 1000000000ULL +
+		       evs[first].input_event_usec * 1000ULL;
+		if (time + TIMED_SLACK_NS < start + TIMED_DELAY_NS)
+			fail(t, "played %llu ns early", (unsigned long long)
+			     (start + TIMED_DELAY_NS - time));
+	}
+
+	trecs[0].flags = 1;
+	check_reject(t, fd, evfd, trecs, sizeof(trecs[0]), EINVAL);
+	trecs[0].flags = 0;
+	rec(&trecs[0].rec, 0, EV_ABS, ABS_X, 1);
+	check_reject(t, fd, evfd, trecs, sizeof(trecs[0]), EINVAL);
+out:
+	if (fd >= 0)
+		close(fd);
+	if (evfd >= 0)
+		close(evfd);
+}
+
+/* control node records, validated as on the device nodes */
+static void test_ctl(int id)
+{
+	const char *t = "control node";
+	int n;
+	struct vinput_record recs[4];
+	struct input_event evs[MAX_EVENTS];
+	int fd = open_wait("/dev/vinputctl", O_RDWR), evfd = open_evdev(id);
+	const struct expect want[] = {
+		{ EV_KEY, KEY_C, 1 }, SYN, { EV_KEY, KEY_C, 0 }, SYN,
+	};
+
+	if (fd < 0 || evfd < 0) {
+		fail(t, "cannot open /dev/vinputctl or the evdev node");
+		goto out;
+	}
+
+	rec(&recs[0], id, EV_KEY, KEY_C, 1);
+	rec(&recs[1], id, EV_SYN, SYN_REPORT, 0);
+	rec(&recs[2], id, EV_KEY, KEY_C, 0);
+	rec(&recs[3], id, EV_SYN, SYN_REPORT, 0);
+	if (write(fd, recs, sizeof(recs)) != sizeof(recs))
+		fail(t, "write: %s", strerror(errno));
+	n = collect(evfd, evs);
+	match(t, evs, n, want, 4);
+
+	rec(&recs[0], id, EV_ABS, ABS_X, 1);
+	check_reject(t, fd, evfd, recs, sizeof(recs[0]), EINVAL);
+	rec(&recs[0], MAX_IDS, EV_KEY, KEY_C, 1);
+	check_reject(t, fd, evfd, recs, sizeof(recs[0]), ENODEV);
+out:
+	if (fd >= 0)
+		close(fd);
+	if (evfd >= 0)
+		close(evfd);
+}
+
+/*
+ * Benchmarks, with no evdev client. The events are the ones handed to the
+ * input core, SYN_REPORT included, as counted in stats/events.
+ */
+static long device_events(int id)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), SYSFS_VINPUT "/vinput%d/stats/events", id);
+	return sysfs_read_ulong(path);
+}
+
+static void bench_report(const char *name, int id, long events0,
+			 uint64_t start)
+{
+	uint64_t elapsed = now_ns() - start;
+	long events = device_events(id) - events0;
+
+	if (events <= 0) {
+		fail(name, "no events counted");
+		return;
+	}
+	printf("%-14s %10ld events %8.1f ns/event\n", name, events,
+	       (double)elapsed / events);
+}
+
+static void bench_text(const char *name, int id, long frames,
+		       const char *const *texts, int ntexts)
+{
+	long i, events0;
+	uint64_t start;
+	int fd = open_vinput(id);
+
+	if (fd < 0) {
+		fail(name, "cannot open vinput%d", id);
+		return;
+	}
+	events0 = device_events(id);
+	start = now_ns();
+	for (i = 0; i < frames; i++) {
+		const char *s = texts[i % ntexts];
+
+		if (write(fd, s, strlen(s)) < 0) {
+			fail(name, "write '%s': %s", s, strerror(errno));
+			break;
+		}
+	}
+	bench_report(name, id, events0, start);
+	close(fd);
+}
+
+#define BENCH_FRAMES	64	/* frames per binary write */
+
+/* vmouse frames of REL_X, REL_Y and SYN_REPORT */
+static void bench_records(const char *name, int id, long frames, int format,
+			  int ctl)
+{
+	int fd, i, n;
+	long done, events0;
+	uint64_t start;
+	struct vinput_record recs[BENCH_FRAMES * 3];
+	struct vinput_timed_record trecs[BENCH_FRAMES * 3];
+	int timed = format == VINPUT_FORMAT_TIMED;
+	void *buf = timed ? (void *)trecs : (void *)recs;
+	size_t size = timed ? sizeof(trecs[0]) : sizeof(recs[0]);
+
+	fd = ctl ? open_wait("/dev/vinputctl", O_RDWR) : open_vinput(id);
+	if (fd < 0 || ioctl(fd, VINPUT_IOC_SET_FORMAT, format)) {
+		fail(name, "cannot open the node or set the format");
+		goto out;
+	}
+
+	/* timed records due at once, the playback timer is measured too */
+	memset(trecs, 0, sizeof(trecs));
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		rec(&recs[3 * i], id, EV_REL, REL_X, i % 2 ? -1 : 1);
+		rec(&recs[3 * i + 1], id, EV_REL, REL_Y, i % 2 ? -1 : 1);
+		rec(&recs[3 * i + 2], id, EV_SYN, SYN_REPORT, 0);
+	}
+	for (i = 0; i < BENCH_FRAMES * 3; i++)
+		trecs[i].rec = recs[i];
+
+	events0 = device_events(id);
+	start = now_ns();
+	for (done = 0; done < frames; done += n) {
+		n = frames - done < BENCH_FRAMES ? frames - done : BENCH_FRAMES;
+		if (write(fd, buf, n * 3 * size) < 0) {
+			fail(name, "write: %s", strerror(errno));
+			goto out;
+		}
+	}
+	if (timed && fsync(fd))
+		fail(name, "fsync: %s", strerror(errno));
+	bench_report(name, id, events0, start);
+out:
+	if (fd >= 0)
+		close(fd);
+}
+
+static void write_text(int id, const char *s)
+{
+	int fd = open_vinput(id);
+
+	if (fd >= 0) {
+		if (write(fd, s, strlen(s)) < 0)
+			fail("bench", "write '%s': %s", s, strerror(errno));
+		close(fd);
+	}
+}
+
+/* frames is even, keys are released and contacts lifted at the end */
+static void bench(long frames, int kbd, int mouse, int ts)
+{
+	static const char *const kbd_texts[] = { "+30", "-30" };
+	static const char *const mouse_texts[] = { "1,1,0,0", "-1,-1,0,0" };
+	static const char *const ts_texts[] = {
+		"1,100,200,50", "1,101,201,50", "1,102,202,50", "1,101,201,50",
+	};
+
+	printf("%ld frames per format\n", frames);
+	bench_text("text vkbd", kbd, frames, kbd_texts, 2);
+	bench_text("text vmouse", mouse, frames, mouse_texts, 2);
+	bench_text("text vts_mt", ts, frames, ts_texts, 4);
+	write_text(ts, "1,0,0,0");
+	bench_records("record", mouse, frames, VINPUT_FORMAT_RECORD, 0);
+	bench_records("timed", mouse, frames, VINPUT_FORMAT_TIMED, 0);
+	bench_records("ctl record", mouse, frames, VINPUT_FORMAT_RECORD, 1);
+	bench_records("ctl timed", mouse, frames, VINPUT_FORMAT_TIMED, 1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	long frames = 0;
+	int kbd, mouse, ts;
+
+	while ((opt = getopt(argc, argv, "b:")) != -1) {
+		switch (opt) {
+		case 'b':
+			frames = strtol(optarg, NULL, 10);
+			frames += frames % 2;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b frames]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (access(SYSFS_VINPUT "/export", W_OK)) {
+		fprintf(stderr, "vinput not loaded, or not run as root\n");
+		return KSFT_SKIP;
+	}
+
+	atexit(unexport_all);
+	kbd = export("vkbd");
+	mouse = export("vmouse");
+	ts = export("vts_mt type=B,max_x=1023,max_y=767,max_z=255,"
+		    "max_points=2");
+	if (kbd < 0 || mouse < 0 || ts < 0)
+		return 1;
+
+	test_vkbd_text(kbd);
+	test_vmouse_text(mouse);
+	test_vts_mt_text(ts);
+	test_record(kbd, mouse);
+	test_timed(mouse);
+	test_ctl(kbd);
+
+	if (frames > 0)
+		bench(frames, kbd, mouse, ts);
+
+	printf("%s\n", failures ? "FAIL" : "PASS");
+
+	return failures ? 1 : 0;
+}
@@ -4,14 +4,28 @@
 #include <linux/init.h>
 #include <linux/input.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
 #include <linux/slab.h>
+#include <linux/kref.h>
 #include <linux/types.h>
+#include <linux/ctype.h>
 #include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+#include <linux/input/mt.h>
 #include <asm/uaccess.h>
 
 #include "vinput.h"
 
 #define DRIVER_NAME	"vinput"
+#define VINPUT_MUX_CHUNK	32
+#define VINPUT_TXN_MAX		1024
+#define VINPUT_URGENT_MAX	64
 
 #define dev_to_vinput(dev)      container_of(dev, struct vinput, dev)
 
@@ -23,6 +37,82 @@ static LIST_HEAD(vinput_vdevices);
 static dev_t vinput_dev;
 static struct spinlock vinput_lock;
 static struct class vinput_class;
+static struct device *vinput_ctl;
+static DEFINE_SPINLOCK(vinput_txn_lock);
+static DEFINE_SPINLOCK(vinput_group_lock);
+
+static unsigned int queue_depth = 512;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Number of events in each device playback queue");
+
+static bool lazy_register;
+module_param(lazy_register, bool, 0644);
+MODULE_PARM_DESC(lazy_register, "Register input devices on their first use only");
+
+static unsigned int pool_size;
+module_param(pool_size, uint, 0444);
+MODULE_PARM_DESC(pool_size, "Number of pre-allocated devices kept for each type");
+
+static unsigned int timer_slack_us = 100;
+module_param(timer_slack_us, uint, 0644);
+MODULE_PARM_DESC(timer_slack_us, "Slack of the playback timer, events due within it are emitted together");
+
+static unsigned int reorder_window_us = 1000;
+module_param(reorder_window_us, uint, 0644);
+MODULE_PARM_DESC(reorder_window_us, "Delay of merged streams, events later than this are merged out of order");
+
+static unsigned int consumer_latency_us = 1000;
+module_param(consumer_latency_us, uint, 0644);
+MODULE_PARM_DESC(consumer_latency_us, "Assumed time for evdev clients to empty their buffer");
+
+static char *devices;
+module_param(devices, charp, 0444);
+MODULE_PARM_DESC(devices, "Devices created when their type registers, as type:count[:key=val,...] separated by ';'");
+
+static unsigned int state_tick_ms = 8;
+module_param(state_tick_ms, uint, 0644);
+MODULE_PARM_DESC(state_tick_ms, "Period of the desired state tick in ms");
+
+static void vinput_state_tick(struct work_struct *work);
+static DECLARE_DELAYED_WORK(vinput_state_work, vinput_state_tick);
+static struct vinput_state vinput_state_snap;
+
+/* limits shared by a group of devices, under vinput_group_lock */
+struct vinput_rate_group {
+	struct vinput_bucket events;
+	struct vinput_bucket frames;
+};
+
+static struct vinput_rate_group vinput_rate_groups[VINPUT_RATE_GROUPS];
+
+struct vinput_file {
+	struct vinput *vinput;
+	struct mutex lock;
+	int format;
+	struct vinput_stream *stream;	/* timed format */
+};
+
+struct vinput_ctl_file {
+	struct mutex lock;
+	int format;
+	int staging;
+	unsigned int count;
+	struct vinput_record *staged;
+};
+
+static const struct file_operations vinput_ctl_fops;
+
+/* bulk creation, exports hold the semaphore for reading */
+static DECLARE_RWSEM(vinput_bulk_sem);
+static int vinput_bulk;
+static atomic_t vinput_bulk_deferred = ATOMIC_INIT(0);
+static u64 vinput_bulk_release_ns;
+
+/* time taken by the successful exports, [1] for those in bulk mode */
+static atomic64_t vinput_export_ns[2];
+static atomic_t vinput_export_count[2];
+
+static atomic64_t vinput_export_gen = ATOMIC64_INIT(0);
 
 struct vinput_device *vinput_get_device_by_type(const char *type)
 {
@@ -33,7 +123,7 @@ struct vinput_device *vinput_get_device_by_type(const char *type)
 	spin_lock(&vinput_lock);
 	list_for_each(curr, &vinput_devices) {
 		vinput = list_entry(curr, struct vinput_device, list);
-		if (vinput && strncmp(type, vinput->name, strlen(vinput->name)) == 0) {
+		if (vinput && sysfs_streq(type, vinput->name)) {
 			found = 1;
 			break;
 		}
@@ -63,125 +153,3305 @@ struct vinput *vinput_get_vdevice_by_id(long id)
 	return ERR_PTR(-ENODEV);
 }
 
-static int vinput_open(struct inode *inode, struct file *file)
+static void vinput_state_contact_event(struct vinput *vinput,
+				       unsigned int code, int value)
 {
-	int err = 0;
-	struct vinput *vinput = NULL;
+	struct vinput_contact *c;
 
-	vinput = vinput_get_vdevice_by_id(iminor(inode));
+	if (code == ABS_MT_SLOT) {
+		vinput->state_slot = value;
+		return;
+	}
+	if (vinput->state_slot < 0 ||
+	    vinput->state_slot >= VINPUT_STATE_CONTACTS)
+		return;
 
-	if (IS_ERR(vinput))
-		err = PTR_ERR(vinput);
-	else
-		file->private_data = vinput;
+	c = &vinput->shadow.contacts[vinput->state_slot];
+	switch (code) {
+	case ABS_MT_TRACKING_ID:
+		c->id = value;
+		if (value < 0)
+			c->z = 0;
+		break;
+	case ABS_MT_POSITION_X:
+		c->x = value;
+		break;
+	case ABS_MT_POSITION_Y:
+		c->y = value;
+		break;
+	case ABS_MT_PRESSURE:
+		c->z = value;
+		break;
+	case ABS_MT_DISTANCE:
+		c->z = -value;
+		break;
+	}
+}
 
-	return err;
+void vinput_event(struct vinput *vinput, unsigned int type,
+		  unsigned int code, int value)
+{
+	unsigned long flags;
+	struct vinput_state *state = &vinput->shadow;
+
+	input_event(vinput->input, type, code, value);
+
+	spin_lock_irqsave(&vinput->state_lock, flags);
+	vinput->flow.frame++;
+
+	/* keys are taken from the input core at sync time */
+	if (type == EV_REL) {
+		if (code == REL_X)
+			state->x += value;
+		else if (code == REL_Y)
+			state->y += value;
+		else if (code == REL_WHEEL)
+			state->wheel += value;
+	} else if (type == EV_ABS) {
+		if (code == ABS_X)
+			state->x = value;
+		else if (code == ABS_Y)
+			state->y = value;
+		else
+			vinput_state_contact_event(vinput, code, value);
+	} else if (type == EV_SYN && code == SYN_MT_REPORT) {
+		/* type A: contacts are reported in order, untouched ones lift */
+		if (++vinput->state_slot < VINPUT_STATE_CONTACTS)
+			state->contacts[vinput->state_slot].z = 0;
+	}
+	spin_unlock_irqrestore(&vinput->state_lock, flags);
 }
+EXPORT_SYMBOL(vinput_event);
 
-static int vinput_release(struct inode *inode, struct file *file)
+/*
+ * input_mt_report_pointer_emulation, reported through vinput_event so
+ * that the state page follows the emulated pointer too.
+ */
+#define VINPUT_TRKID_SGN	((0xffff + 1) >> 1)
+
+void vinput_mt_report_pointer_emulation(struct vinput *vinput)
 {
-	return 0;
+	int i, id;
+	int count = 0;
+	struct input_dev *input = vinput->input;
+	struct input_mt *mt = input->mt;
+	struct input_mt_slot *oldest = NULL;
+	int oldid;
+
+	if (!mt)
+		return;
+
+	oldid = mt->trkid;
+	for (i = 0; i < mt->num_slots; i++) {
+		id = input_mt_get_value(&mt->slots[i], ABS_MT_TRACKING_ID);
+		if (id < 0)
+			continue;
+		if ((id - oldid) & VINPUT_TRKID_SGN) {
+			oldest = &mt->slots[i];
+			oldid = id;
+		}
+		count++;
+	}
+
+	vinput_report_key(vinput, BTN_TOUCH, count > 0);
+	vinput_report_key(vinput, BTN_TOOL_FINGER, count == 1);
+	vinput_report_key(vinput, BTN_TOOL_DOUBLETAP, count == 2);
+	vinput_report_key(vinput, BTN_TOOL_TRIPLETAP, count == 3);
+	vinput_report_key(vinput, BTN_TOOL_QUADTAP, count == 4);
+	vinput_report_key(vinput, BTN_TOOL_QUINTTAP, count == 5);
+
+	if (oldest) {
+		vinput_report_abs(vinput, ABS_X,
+				  input_mt_get_value(oldest, ABS_MT_POSITION_X));
+		vinput_report_abs(vinput, ABS_Y,
+				  input_mt_get_value(oldest, ABS_MT_POSITION_Y));
+	}
+	if (test_bit(ABS_MT_PRESSURE, input->absbit))
+		vinput_report_abs(vinput, ABS_PRESSURE, oldest ?
+				  input_mt_get_value(oldest, ABS_MT_PRESSURE) : 0);
 }
+EXPORT_SYMBOL(vinput_mt_report_pointer_emulation);
 
-static ssize_t vinput_read(struct file *file, char __user *buffer,
-			   size_t count, loff_t *offset)
+static void vinput_state_publish(struct vinput *vinput)
 {
-	int len;
-	char buff[VINPUT_MAX_LEN + 1];
-	struct vinput *vinput = file->private_data;
+	int i;
+	struct vinput_state *page = vinput->observed;
+	struct vinput_state *state = &vinput->shadow;
+	struct input_dev *input = vinput->input;
 
-	len = vinput->type->ops->read(vinput, buff, count);
+	for (i = 0; i < VINPUT_STATE_KEYS; i++) {
+#if BITS_PER_LONG == 64
+		state->keys[i] = input->key[i];
+#else
+		state->keys[i] = input->key[2 * i] |
+				 (u64)input->key[2 * i + 1] << 32;
+#endif
+	}
 
-	if (*offset > len)
-		count = 0;
-	else if (count + *offset > VINPUT_MAX_LEN)
-		count = len - *offset;
+	WRITE_ONCE(page->seq, page->seq + 1);
+	smp_wmb();
+	memcpy(page->keys, state->keys, offsetof(struct vinput_state, reserved) -
+					offsetof(struct vinput_state, keys));
+	smp_wmb();
+	WRITE_ONCE(page->seq, page->seq + 1);
 
-	if (copy_to_user(buffer, buff + *offset, count))
-		count = -EFAULT;
+	if (!input->mt && test_bit(ABS_MT_POSITION_X, input->absbit)) {
+		for (i = vinput->state_slot; i < VINPUT_STATE_CONTACTS; i++)
+			state->contacts[i].z = 0;
+		vinput->state_slot = 0;
+		state->contacts[0].z = 0;
+	}
+}
 
-	*offset += count;
+/*
+ * evdev gives each client a ring of 8 packets of hint_events_per_packet
+ * events, at least 64, and drops its whole content when it overflows.
+ * We cannot see how fast clients read, so we assume they empty it every
+ * consumer_latency_us and account for what is sent in between: drops are
+ * only estimated, not detected.
+ */
+#define VINPUT_EVDEV_MIN_BUFFER	64U
+#define VINPUT_EVDEV_PACKETS	8
 
-	return count;
+static unsigned int vinput_evdev_bufsize(struct input_dev *input)
+{
+	unsigned int size = input->hint_events_per_packet * VINPUT_EVDEV_PACKETS;
+
+	return roundup_pow_of_two(max(size, VINPUT_EVDEV_MIN_BUFFER));
 }
 
-static ssize_t vinput_write(struct file *file, const char __user *buffer,
-			    size_t count, loff_t *offset)
+static void vinput_flow_account(struct vinput *vinput)
 {
-	char buff[VINPUT_MAX_LEN + 1];
-	struct vinput *vinput = file->private_data;
+	u64 now = ktime_get_ns();
+	struct vinput_flow *flow = &vinput->flow;
+	unsigned int size = flow->frame + 1;	/* and the SYN_REPORT */
+	unsigned int bufsize = vinput_evdev_bufsize(vinput->input);
 
-	memset(buff, 0, sizeof(char) * (VINPUT_MAX_LEN + 1));
+	flow->events += size;
+	flow->frames++;
+	flow->frame = 0;
+	flow->last_frame = size;
 
-	if (count > VINPUT_MAX_LEN) {
-		dev_warn(&vinput->dev, "Too long. %d bytes allowed\n", VINPUT_MAX_LEN);
+	if (now - flow->window > consumer_latency_us * NSEC_PER_USEC) {
+		flow->window = now;
+		flow->backlog = 0;
+	}
+	flow->backlog += size;
+	if (flow->backlog > bufsize)
+		flow->est_drops += min(size, flow->backlog - bufsize);
+}
+
+/*
+ * With throttling enabled, wait for the consumers to catch up when the
+ * next frame would overflow their buffers.
+ */
+static int vinput_flow_wait(struct vinput *vinput, int nonblock)
+{
+	u64 end;
+	ktime_t expires;
+	unsigned long flags;
+	struct vinput_flow *flow = &vinput->flow;
+
+	if (!flow->throttle)
+		return 0;
+
+	for (;;) {
+		spin_lock_irqsave(&vinput->state_lock, flags);
+		end = flow->window + consumer_latency_us * NSEC_PER_USEC;
+		if (ktime_get_ns() >= end || flow->backlog + flow->last_frame <=
+		    vinput_evdev_bufsize(vinput->input))
+			end = 0;
+		else
+			flow->throttled++;
+		spin_unlock_irqrestore(&vinput->state_lock, flags);
+
+		if (!end)
+			return 0;
+		if (nonblock)
+			return -EAGAIN;
+
+		expires = ns_to_ktime(end);
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
+}
+
+/*
+ * Rate limits. Frames are charged to the token buckets of their device,
+ * and of its group, once sent: a writer may run into debt, it is then
+ * held back until the buckets refill. Buckets hold up to a tenth of a
+ * second worth of tokens.
+ */
+#define VINPUT_RATE_DROPPED	1
+
+static void vinput_bucket_set(struct vinput_bucket *b, unsigned int rate)
+{
+	b->rate = rate;
+	b->tokens = 0;
+	b->last = ktime_get_ns();
+}
+
+static void vinput_bucket_refill(struct vinput_bucket *b, u64 now)
+{
+	s64 burst = (s64)max(b->rate / 10, 1U) * NSEC_PER_SEC;
+	u64 elapsed = min_t(u64, now - b->last, NSEC_PER_SEC);
+
+	b->last = now;
+	b->tokens = min_t(s64, b->tokens + elapsed * b->rate, burst);
+}
+
+static void vinput_bucket_charge(struct vinput_bucket *b, u64 now,
+				 unsigned int n)
+{
+	if (!b->rate)
+		return;
+
+	vinput_bucket_refill(b, now);
+	b->tokens -= (s64)n * NSEC_PER_SEC;
+}
+
+/* time in ns until the bucket is out of debt */
+static u64 vinput_bucket_debt(struct vinput_bucket *b, u64 now)
+{
+	if (!b->rate)
+		return 0;
+
+	vinput_bucket_refill(b, now);
+	if (b->tokens >= 0)
+		return 0;
+
+	return div_u64(-b->tokens, b->rate) + 1;
+}
+
+/* called with state_lock held */
+static void vinput_rate_charge(struct vinput *vinput, unsigned int events)
+{
+	u64 now = ktime_get_ns();
+	struct vinput_rate *rate = &vinput->rate;
+	struct vinput_rate_group *group;
+
+	vinput_bucket_charge(&rate->events, now, events);
+	vinput_bucket_charge(&rate->frames, now, 1);
+
+	if (!rate->group)
+		return;
+
+	group = &vinput_rate_groups[rate->group - 1];
+	spin_lock(&vinput_group_lock);
+	vinput_bucket_charge(&group->events, now, events);
+	vinput_bucket_charge(&group->frames, now, 1);
+	spin_unlock(&vinput_group_lock);
+}
+
+/* called with state_lock held */
+static u64 vinput_rate_debt(struct vinput *vinput, u64 now)
+{
+	u64 debt;
+	struct vinput_rate *rate = &vinput->rate;
+	struct vinput_rate_group *group;
+
+	debt = max(vinput_bucket_debt(&rate->events, now),
+		   vinput_bucket_debt(&rate->frames, now));
+
+	if (!rate->group)
+		return debt;
+
+	group = &vinput_rate_groups[rate->group - 1];
+	spin_lock(&vinput_group_lock);
+	debt = max(debt, vinput_bucket_debt(&group->events, now));
+	debt = max(debt, vinput_bucket_debt(&group->frames, now));
+	spin_unlock(&vinput_group_lock);
+
+	return debt;
+}
+
+/*
+ * Hold the writer back while the device is in debt. In drop mode return
+ * VINPUT_RATE_DROPPED instead, and the caller drops the write.
+ */
+static int vinput_rate_wait(struct vinput *vinput, int nonblock)
+{
+	u64 now, debt;
+	ktime_t expires;
+	unsigned long flags;
+
+	for (;;) {
+		spin_lock_irqsave(&vinput->state_lock, flags);
+		now = ktime_get_ns();
+		debt = vinput_rate_debt(vinput, now);
+		spin_unlock_irqrestore(&vinput->state_lock, flags);
+
+		if (!debt)
+			return 0;
+		if (vinput->rate.mode == VINPUT_RATE_DROP)
+			return VINPUT_RATE_DROPPED;
+		if (nonblock)
+			return -EAGAIN;
+
+		expires = ns_to_ktime(now + debt);
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
+}
+
+static void vinput_rate_drop(struct vinput *vinput)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&vinput->state_lock, flags);
+	vinput->rate.dropped++;
+	spin_unlock_irqrestore(&vinput->state_lock, flags);
+}
+
+static unsigned int vinput_rate_min(unsigned int a, unsigned int b)
+{
+	if (!a || !b)
+		return a ? a : b;
+	return min(a, b);
+}
+
+/* restart pacing from now, called with state_lock held */
+static void vinput_rate_reset(struct vinput_rate *rate)
+{
+	rate->paced = 0;
+	rate->pace_events = 0;
+}
+
+/*
+ * Queue mode: playback time of a record, the events of a frame share
+ * the time of the frame and frames are spread at the limited rates.
+ */
+static u64 vinput_rate_pace(struct vinput *vinput,
+			    const struct vinput_record *rec)
+{
+	u64 time, gap = 0;
+	unsigned long flags;
+	unsigned int events, frames;
+	struct vinput_rate *rate = &vinput->rate;
+
+	spin_lock_irqsave(&vinput->state_lock, flags);
+	events = rate->events.rate;
+	frames = rate->frames.rate;
+	if (rate->group) {
+		spin_lock(&vinput_group_lock);
+		events = vinput_rate_min(events,
+				vinput_rate_groups[rate->group - 1].events.rate);
+		frames = vinput_rate_min(frames,
+				vinput_rate_groups[rate->group - 1].frames.rate);
+		spin_unlock(&vinput_group_lock);
+	}
+
+	if (!rate->pace_events)
+		rate->paced = max(rate->paced, ktime_get_ns());
+	time = rate->paced;
+	rate->pace_events++;
+
+	if (rec->type == EV_SYN && rec->code == SYN_REPORT) {
+		if (events)
+			gap = div_u64((u64)rate->pace_events * NSEC_PER_SEC,
+				      events);
+		if (frames)
+			gap = max(gap, div_u64(NSEC_PER_SEC, frames));
+		rate->paced += gap;
+		rate->pace_events = 0;
+	}
+	spin_unlock_irqrestore(&vinput->state_lock, flags);
+
+	return time;
+}
+
+void vinput_sync(struct vinput *vinput)
+{
+	unsigned long flags;
+
+	input_sync(vinput->input);
+
+	spin_lock_irqsave(&vinput->state_lock, flags);
+	vinput_flow_account(vinput);
+	vinput_rate_charge(vinput, vinput->flow.last_frame);
+	vinput_state_publish(vinput);
+	spin_unlock_irqrestore(&vinput->state_lock, flags);
+}
+EXPORT_SYMBOL(vinput_sync);
+
+/*
+ * Frames emitted by the core (records, queued, urgent and state page
+ * events) go through these: the begin op of the type is called before the
+ * first event of a frame and its commit op before the frame is synced.
+ * Types with a send_batch op get device fd records instead.
+ */
+static void vinput_frame_begin(struct vinput *vinput)
+{
+	if (vinput->type->ops->begin)
+		vinput->type->ops->begin(vinput);
+}
+
+static void vinput_frame_commit(struct vinput *vinput)
+{
+	if (vinput->type->ops->commit)
+		vinput->type->ops->commit(vinput);
+	vinput_sync(vinput);
+}
+
+/* a record may only carry an event type the device has */
+static int vinput_record_check(struct vinput *vinput,
+			       const struct vinput_record *rec)
+{
+	if (rec->type > EV_MAX ||
+	    (rec->type != EV_SYN && !test_bit(rec->type, vinput->input->evbit)))
 		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Every write (or every device touched by a control node write) is a
+ * batch. Batches get a sequence number when submitted and the last
+ * completed one is published in the state page and signaled through the
+ * optional eventfd. A batch that failed, or whose events were dropped,
+ * completes too and is published as the last failed one.
+ */
+static u64 vinput_batch_submit(struct vinput *vinput)
+{
+	return atomic64_inc_return(&vinput->submitted);
+}
+
+static void vinput_batch_done(struct vinput *vinput, u64 seq, int err)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&vinput->state_lock, flags);
+	if (err && seq > vinput->failed) {
+		vinput->failed = seq;
+		WRITE_ONCE(vinput->observed->failed, seq);
+	}
+	if (seq > vinput->completed) {
+		vinput->completed = seq;
+		WRITE_ONCE(vinput->observed->completed, seq);
+	}
+	if (vinput->done_ctx)
+		eventfd_signal(vinput->done_ctx, 1);
+	spin_unlock_irqrestore(&vinput->state_lock, flags);
+}
+
+static int vinput_set_eventfd(struct vinput *vinput, int fd)
+{
+	unsigned long flags;
+	struct eventfd_ctx *ctx = NULL;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
 	}
 
-	if (copy_from_user(buff, buffer, count))
-		return -EFAULT;
+	spin_lock_irqsave(&vinput->state_lock, flags);
+	swap(ctx, vinput->done_ctx);
+	spin_unlock_irqrestore(&vinput->state_lock, flags);
 
-	return vinput->type->ops->send(vinput, buff, count);
+	if (ctx)
+		eventfd_ctx_put(ctx);
+
+	return 0;
 }
 
-static const struct file_operations vinput_fops = {
-	.owner = THIS_MODULE,
-	.open = vinput_open,
-	.release = vinput_release,
-	.read = vinput_read,
-	.write = vinput_write,
+/*
+ * Delivery latency. The injection paths stamp the frames they send and an
+ * internal input handler, connected after evdev, measures the time taken
+ * to hand them over to the clients when their SYN_REPORT comes through.
+ * Concurrent writers to a device share the stamp, so this is approximate.
+ */
+static void vinput_lat_begin(struct vinput *vinput, u64 stamp)
+{
+	WRITE_ONCE(vinput->latency.inject, stamp);
+}
+
+static void vinput_lat_end(struct vinput *vinput)
+{
+	WRITE_ONCE(vinput->latency.inject, 0);
+}
+
+static void vinput_lat_event(struct input_handle *handle, unsigned int type,
+			     unsigned int code, int value)
+{
+	u64 stamp, delta;
+	struct vinput *vinput = handle->private;
+	struct vinput_latency *lat = &vinput->latency;
+
+	if (type != EV_SYN || code != SYN_REPORT)
+		return;
+
+	/* autorepeat and the like were not injected by us */
+	stamp = READ_ONCE(lat->inject);
+	if (!stamp)
+		return;
+	delta = ktime_get_ns() - stamp;
+
+	spin_lock(&lat->lock);
+	lat->buckets[min(fls64(delta), VINPUT_LAT_BUCKETS - 1)]++;
+	lat->count++;
+	if (delta > lat->max)
+		lat->max = delta;
+	spin_unlock(&lat->lock);
+}
+
+static int vinput_lat_connect(struct input_handler *handler,
+			      struct input_dev *dev,
+			      const struct input_device_id *id)
+{
+	int err;
+	struct input_handle *handle;
+	struct device *parent = dev->dev.parent;
+
+	if (!parent || parent->class != &vinput_class)
+		return -ENODEV;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "vinput-lat";
+	handle->private = container_of(parent, struct vinput, dev);
+
+	err = input_register_handle(handle);
+	if (err)
+		goto fail_register;
+
+	err = input_open_device(handle);
+	if (err)
+		goto fail_open;
+
+	return 0;
+fail_open:
+	input_unregister_handle(handle);
+fail_register:
+	kfree(handle);
+	return err;
+}
+
+static void vinput_lat_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id vinput_lat_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_BUS,
+		.bustype = BUS_VIRTUAL,
+	},
+	{ },
 };
 
-static void vinput_unregister_vdevice(struct vinput *vinput)
+static struct input_handler vinput_lat_handler = {
+	.event = vinput_lat_event,
+	.connect = vinput_lat_connect,
+	.disconnect = vinput_lat_disconnect,
+	.name = "vinput-lat",
+	.id_table = vinput_lat_ids,
+};
+
+/* upper bound of the bucket holding the pct percentile */
+static u64 vinput_lat_percentile(const struct vinput_latency *lat,
+				 unsigned int pct)
 {
-	input_unregister_device(vinput->input);
-	if (vinput->type->ops->kill)
-		vinput->type->ops->kill(vinput);
+	unsigned int i;
+	unsigned long sum = 0;
+	unsigned long rank = DIV_ROUND_UP(lat->count * pct, 100);
+
+	if (!lat->count)
+		return 0;
+
+	for (i = 0; i < VINPUT_LAT_BUCKETS; i++) {
+		sum += lat->buckets[i];
+		if (sum >= rank)
+			break;
+	}
+
+	return min_t(u64, 1ULL << i, lat->max);
 }
 
-static void vinput_destroy_vdevice(struct vinput *vinput)
+/*
+ * Timed playback. Each device has streams of events ordered by time: the
+ * control node one and one per device fd in timed mode. They are merged by
+ * timestamp, a frame at a time, and held back by reorder_window_us when
+ * there are several so that slightly late producers still get merged in
+ * order. The devices with queued events sit in a single timeline ordered
+ * by their next deadline, and one hrtimer emits the due events of all of
+ * them, from interrupt context. The timer is armed with timer_slack_us of
+ * slack so that it can be coalesced, and events due within the slack are
+ * emitted along. Producers keep a couple of slots free for the closing
+ * sync and batch marker.
+ */
+#define VINPUT_QUEUE_RESERVE	2
+
+static DEFINE_SPINLOCK(vinput_sched_lock);
+static struct rb_root vinput_sched_root = RB_ROOT;
+static struct hrtimer vinput_sched_timer;
+static u64 vinput_sched_expires;	/* 0 when not armed */
+
+/* queue_cur is the stream whose frame is open. queue_lock held */
+static void vinput_queue_emit(struct vinput *vinput,
+			      struct vinput_stream *stream,
+			      const struct vinput_qevent *ev)
 {
-	/* Remove from the list first */
-	spin_lock(&vinput_lock);
-	list_del(&vinput->list);
-	clear_bit(vinput->id, vinput_ids);
-	spin_unlock(&vinput_lock);
+	if (ev->type == VINPUT_QEV_DONE) {
+		vinput->queue_cur = NULL;
+		vinput_batch_done(vinput, ev->seq, 0);
+	} else if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+		if (!vinput->queue_cur)
+			vinput_frame_begin(vinput);
+		vinput->queue_cur = NULL;
+		vinput_frame_commit(vinput);
+	} else {
+		if (!vinput->queue_cur)
+			vinput_frame_begin(vinput);
+		vinput->queue_cur = stream;
+		vinput_event(vinput, ev->type, ev->code, ev->value);
+	}
+}
+
+/* called with vinput_sched_lock held */
+static void vinput_sched_arm(u64 time)
+{
+	if (vinput_sched_expires && vinput_sched_expires <= time)
+		return;
+
+	vinput_sched_expires = time;
+	hrtimer_start_range_ns(&vinput_sched_timer, ns_to_ktime(time),
+			       (u64)timer_slack_us * NSEC_PER_USEC,
+			       HRTIMER_MODE_ABS);
+}
+
+/* called with vinput_sched_lock held */
+static void vinput_sched_del(struct vinput *vinput)
+{
+	if (RB_EMPTY_NODE(&vinput->sched_node))
+		return;
+
+	rb_erase(&vinput->sched_node, &vinput_sched_root);
+	RB_CLEAR_NODE(&vinput->sched_node);
+}
+
+/* called with vinput_sched_lock held */
+static void vinput_sched_insert(struct vinput *vinput, u64 time)
+{
+	struct rb_node **link = &vinput_sched_root.rb_node;
+	struct rb_node *parent = NULL;
+
+	if (READ_ONCE(vinput->queue_stopped))
+		return;
+	if (!RB_EMPTY_NODE(&vinput->sched_node)) {
+		if (vinput->sched_time <= time)
+			return;
+		vinput_sched_del(vinput);
+	}
+
+	while (*link) {
+		parent = *link;
+		if (time < rb_entry(parent, struct vinput, sched_node)->sched_time)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	vinput->sched_time = time;
+	rb_link_node(&vinput->sched_node, parent, link);
+	rb_insert_color(&vinput->sched_node, &vinput_sched_root);
+
+	vinput_sched_arm(time);
+}
+
+static void vinput_sched_add(struct vinput *vinput, u64 time)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&vinput_sched_lock, flags);
+	vinput_sched_insert(vinput, time);
+	spin_unlock_irqrestore(&vinput_sched_lock, flags);
+}
+
+/*
+ * Frames written directly (device fd, control node, vinput_inject) are
+ * emitted under queue_lock too, but may span several locked sections.
+ * While one is open the timer holds the device back, as between the
+ * frames of a stream, so that no played frame lands in the middle of it.
+ * The last one committed puts a held device back on the timeline. The
+ * other way round, a played frame in progress is completed before a
+ * direct one starts and the rest of its stream makes a frame of its own.
+ */
+
+/* queue_lock held */
+static void vinput_queue_cut(struct vinput *vinput)
+{
+	if (!vinput->queue_cur)
+		return;
+
+	vinput->queue_cur = NULL;
+	vinput_frame_commit(vinput);
+	/* the timer may have stopped on that frame */
+	vinput->queue_held = 1;
+}
+
+/* queue_lock held */
+static void vinput_direct_begin(struct vinput *vinput)
+{
+	vinput_queue_cut(vinput);
+	vinput->frame_open++;
+	vinput_frame_begin(vinput);
+}
+
+/*
+ * queue_lock held, returns whether a device that left the timeline has to
+ * be put back on it with vinput_queue_resume()
+ */
+static int vinput_queue_unhold(struct vinput *vinput)
+{
+	if (vinput->frame_open || !vinput->queue_held)
+		return 0;
+
+	vinput->queue_held = 0;
+	return 1;
+}
+
+/* queue_lock held */
+static int vinput_direct_close(struct vinput *vinput)
+{
+	vinput->frame_open--;
+	return vinput_queue_unhold(vinput);
+}
+
+static int vinput_direct_commit(struct vinput *vinput)
+{
+	vinput_frame_commit(vinput);
+	return vinput_direct_close(vinput);
+}
+
+/* the timer puts it back at the time of its next event */
+static void vinput_queue_resume(struct vinput *vinput)
+{
+	vinput_sched_add(vinput, ktime_get_ns());
+}
+
+/* commit the frame a direct write left open */
+static void vinput_direct_end(struct vinput *vinput)
+{
+	int resume = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vinput->queue_lock, flags);
+	/* teardown stops the queue before releasing the input */
+	if (!vinput->queue_stopped)
+		resume = vinput_direct_commit(vinput);
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+
+	if (resume)
+		vinput_queue_resume(vinput);
+}
+
+/* only hold events back when there is something to merge */
+static u64 vinput_queue_delay(struct vinput *vinput)
+{
+	if (list_is_singular(&vinput->streams))
+		return 0;
+
+	return (u64)reorder_window_us * NSEC_PER_USEC;
+}
+
+/* the stream holding the next event to play, called with queue_lock held */
+static struct vinput_stream *vinput_queue_next(struct vinput *vinput,
+					       struct vinput_qevent *ev)
+{
+	struct vinput_qevent head;
+	struct vinput_stream *stream, *next = NULL;
+
+	/* streams are only switched between frames */
+	if (vinput->queue_cur)
+		return kfifo_peek(&vinput->queue_cur->fifo, ev) ?
+			vinput->queue_cur : NULL;
+
+	/* nor in the middle of a direct frame */
+	if (vinput->frame_open) {
+		vinput->queue_held = 1;
+		return NULL;
+	}
+
+	list_for_each_entry(stream, &vinput->streams, list) {
+		if (!kfifo_peek(&stream->fifo, &head))
+			continue;
+		if (!next || head.time < ev->time) {
+			next = stream;
+			*ev = head;
+		}
+	}
+
+	return next;
+}
+
+/* emit the events of a device due before horizon, reschedule the rest */
+static void vinput_queue_run(struct vinput *vinput, u64 horizon)
+{
+	u64 delay;
+	struct vinput_qevent ev;
+	struct vinput_stream *stream;
+
+	spin_lock(&vinput->queue_lock);
+	delay = vinput_queue_delay(vinput);
+	while ((stream = vinput_queue_next(vinput, &ev))) {
+		if (ev.time + delay > horizon) {
+			vinput_sched_insert(vinput, ev.time + delay);
+			break;
+		}
+		kfifo_skip(&stream->fifo);
+		vinput_lat_begin(vinput, ev.time);
+		vinput_queue_emit(vinput, stream, &ev);
+	}
+	vinput_lat_end(vinput);
+	spin_unlock(&vinput->queue_lock);
+
+	wake_up_interruptible(&vinput->queue_wait);
+}
+
+static enum hrtimer_restart vinput_sched_timer_fn(struct hrtimer *timer)
+{
+	u64 horizon;
+	unsigned long flags;
+	struct rb_node *node;
+	struct vinput *vinput;
+
+	horizon = ktime_get_ns() + (u64)timer_slack_us * NSEC_PER_USEC;
+
+	spin_lock_irqsave(&vinput_sched_lock, flags);
+	vinput_sched_expires = 0;
+	while ((node = rb_first(&vinput_sched_root))) {
+		vinput = rb_entry(node, struct vinput, sched_node);
+		if (vinput->sched_time > horizon) {
+			vinput_sched_arm(vinput->sched_time);
+			break;
+		}
+		vinput_sched_del(vinput);
+		vinput_queue_run(vinput, horizon);
+	}
+	spin_unlock_irqrestore(&vinput_sched_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static int vinput_queue_push(struct vinput *vinput,
+			     struct vinput_stream *stream,
+			     const struct vinput_qevent *ev,
+			     unsigned int reserve)
+{
+	u64 delay;
+	int err = 0;
+	int first = 0;
+	unsigned long flags;
+	struct vinput_qevent qev = *ev;
+
+	spin_lock_irqsave(&vinput->queue_lock, flags);
+	if (vinput->queue_stopped) {
+		err = -ENODEV;
+		goto out;
+	}
+	if (kfifo_avail(&stream->fifo) <= reserve) {
+		err = -EAGAIN;
+		goto out;
+	}
+
+	/* too late to be merged in order, a 0 time just follows the stream */
+	delay = vinput_queue_delay(vinput);
+	if (delay && qev.time && qev.time + delay < ktime_get_ns())
+		vinput->queue_late++;
+
+	/* a stream plays in order, never go back in time */
+	if (qev.time < stream->tail)
+		qev.time = stream->tail;
+	stream->tail = qev.time;
+	/*
+	 * A new head may come before the scheduled time, and a device off
+	 * the timeline may have stopped on this stream in the middle of a
+	 * frame. Racing with the timer only costs a spurious run.
+	 */
+	first = kfifo_is_empty(&stream->fifo) ||
+		RB_EMPTY_NODE(&vinput->sched_node);
+	kfifo_in(&stream->fifo, &qev, 1);
+out:
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+
+	/* the timer takes the queue locks under the scheduler lock */
+	if (first)
+		vinput_sched_add(vinput, qev.time + delay);
+
+	return err;
+}
+
+static int vinput_queue_room(struct vinput_stream *stream,
+			     unsigned int reserve)
+{
+	return kfifo_avail(&stream->fifo) > reserve;
+}
+
+static int vinput_queue_push_wait(struct vinput *vinput,
+				  struct vinput_stream *stream,
+				  const struct vinput_qevent *ev,
+				  unsigned int reserve, int nonblock)
+{
+	int err;
+
+	while ((err = vinput_queue_push(vinput, stream, ev, reserve)) ==
+	       -EAGAIN) {
+		if (nonblock)
+			break;
+		err = wait_event_interruptible(vinput->queue_wait,
+					       vinput_queue_room(stream, reserve));
+		if (err)
+			break;
+	}
+
+	return err;
+}
+
+/*
+ * Queue the closing sync of an open frame and the marker of batch seq.
+ * Producers leave VINPUT_QUEUE_RESERVE slots for them, but other writers
+ * of a shared stream may have taken those: rather than blocking, the batch
+ * is then completed at once as failed.
+ */
+static void vinput_queue_close(struct vinput *vinput,
+			       struct vinput_stream *stream, int pending,
+			       u64 seq)
+{
+	int err = 0;
+	struct vinput_qevent ev = { 0 };
+
+	if (pending) {
+		ev.type = EV_SYN;
+		ev.code = SYN_REPORT;
+		err = vinput_queue_push(vinput, stream, &ev, 0);
+	}
+
+	ev.type = VINPUT_QEV_DONE;
+	ev.seq = seq;
+	if (!err)
+		err = vinput_queue_push(vinput, stream, &ev, 0);
+	if (err)
+		vinput_batch_done(vinput, seq, err);
+}
+
+static int vinput_queue_empty(struct vinput *vinput)
+{
+	int empty = 1;
+	unsigned long flags;
+	struct vinput_stream *stream;
+
+	spin_lock_irqsave(&vinput->queue_lock, flags);
+	list_for_each_entry(stream, &vinput->streams, list)
+		empty &= kfifo_is_empty(&stream->fifo);
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+
+	return empty;
+}
+
+/* take a device left with nothing to play off the timeline */
+static void vinput_sched_idle(struct vinput *vinput)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&vinput_sched_lock, flags);
+	if (vinput_queue_empty(vinput))
+		vinput_sched_del(vinput);
+	spin_unlock_irqrestore(&vinput_sched_lock, flags);
+}
+
+static int vinput_queue_drain(struct vinput *vinput)
+{
+	return wait_event_interruptible(vinput->queue_wait,
+					vinput_queue_empty(vinput));
+}
+
+static int vinput_queue_init(struct vinput *vinput)
+{
+	spin_lock_init(&vinput->queue_lock);
+	init_waitqueue_head(&vinput->queue_wait);
+	RB_CLEAR_NODE(&vinput->sched_node);
+	INIT_LIST_HEAD(&vinput->streams);
+	list_add(&vinput->queue.list, &vinput->streams);
+
+	return kfifo_alloc(&vinput->queue.fifo, queue_depth, GFP_KERNEL);
+}
+
+/* drop the queued events, completing their batches. queue_lock held */
+static void vinput_stream_flush(struct vinput *vinput,
+				struct vinput_stream *stream)
+{
+	struct vinput_qevent ev;
+
+	while (kfifo_get(&stream->fifo, &ev))
+		if (ev.type == VINPUT_QEV_DONE)
+			vinput_batch_done(vinput, ev.seq, -ECANCELED);
+
+	/* what comes next is not held back to the time of the dropped events */
+	stream->tail = 0;
+}
+
+static struct vinput_stream *vinput_stream_open(struct vinput *vinput)
+{
+	int err;
+	unsigned long flags;
+	struct vinput_stream *stream;
+
+	stream = kzalloc(sizeof(struct vinput_stream), GFP_KERNEL);
+	if (!stream)
+		return ERR_PTR(-ENOMEM);
+
+	err = kfifo_alloc(&stream->fifo, queue_depth, GFP_KERNEL);
+	if (err)
+		goto fail_fifo;
+
+	spin_lock_irqsave(&vinput->queue_lock, flags);
+	if (vinput->queue_stopped)
+		err = -ENODEV;
+	else
+		list_add_tail(&stream->list, &vinput->streams);
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+	if (err)
+		goto fail_stopped;
+
+	return stream;
+
+fail_stopped:
+	kfifo_free(&stream->fifo);
+fail_fifo:
+	kfree(stream);
+	return ERR_PTR(err);
+}
+
+/*
+ * What is left in a closed stream is dropped, a partial frame synced.
+ * Once the device is stopped its input device may be gone, the stream is
+ * only unlinked then.
+ */
+static void vinput_stream_close(struct vinput *vinput,
+				struct vinput_stream *stream)
+{
+	int resume = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vinput->queue_lock, flags);
+	if (!vinput->queue_stopped) {
+		vinput_stream_flush(vinput, stream);
+		/* the other streams were waiting for the end of its frame */
+		if (vinput->queue_cur == stream) {
+			vinput_queue_cut(vinput);
+			resume = vinput_queue_unhold(vinput);
+		}
+	}
+	list_del(&stream->list);
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+
+	if (resume)
+		vinput_queue_resume(vinput);
+
+	wake_up_interruptible(&vinput->queue_wait);
+
+	kfifo_free(&stream->fifo);
+	kfree(stream);
+}
+
+static void vinput_queue_stop(struct vinput *vinput)
+{
+	unsigned long flags;
+	struct vinput_stream *stream;
+
+	spin_lock_irqsave(&vinput->queue_lock, flags);
+	vinput->queue_stopped = 1;
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+
+	/* the timer runs the devices under the scheduler lock */
+	spin_lock_irqsave(&vinput_sched_lock, flags);
+	vinput_sched_del(vinput);
+	spin_unlock_irqrestore(&vinput_sched_lock, flags);
+
+	spin_lock_irqsave(&vinput->queue_lock, flags);
+	list_for_each_entry(stream, &vinput->streams, list)
+		kfifo_reset(&stream->fifo);
+	vinput->queue_cur = NULL;
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+
+	wake_up_interruptible_all(&vinput->queue_wait);
+}
+
+static int vinput_state_key(const struct vinput_state *state,
+			    unsigned int code)
+{
+	return !!(state->keys[code / 64] & (1ULL << (code % 64)));
+}
+
+static int vinput_state_apply_keys(struct vinput *vinput,
+				   const struct vinput_state *want)
+{
+	int i;
+	int changed = 0;
+	unsigned int code;
+	struct input_dev *input = vinput->input;
+	struct vinput_state *cur = vinput->applied;
+
+	for (i = 0; i < VINPUT_STATE_KEYS; i++) {
+		if (want->keys[i] == cur->keys[i])
+			continue;
+		for (code = i * 64; code < (i + 1) * 64 && code < KEY_CNT; code++) {
+			if (vinput_state_key(want, code) == vinput_state_key(cur, code) ||
+			    !test_bit(code, input->keybit))
+				continue;
+			vinput_report_key(vinput, code, vinput_state_key(want, code));
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+static int vinput_state_apply_pointer(struct vinput *vinput,
+				      const struct vinput_state *want)
+{
+	int changed = 0;
+	struct input_dev *input = vinput->input;
+	struct vinput_state *cur = vinput->applied;
+
+	if (!test_bit(EV_REL, input->evbit))
+		return 0;
+
+	if (want->x != cur->x && test_bit(REL_X, input->relbit)) {
+		vinput_report_rel(vinput, REL_X, want->x - cur->x);
+		changed = 1;
+	}
+	if (want->y != cur->y && test_bit(REL_Y, input->relbit)) {
+		vinput_report_rel(vinput, REL_Y, want->y - cur->y);
+		changed = 1;
+	}
+	if (want->wheel != cur->wheel && test_bit(REL_WHEEL, input->relbit)) {
+		vinput_report_rel(vinput, REL_WHEEL, want->wheel - cur->wheel);
+		changed = 1;
+	}
+
+	return changed;
+}
+
+static void vinput_state_report_contact(struct vinput *vinput,
+					const struct vinput_contact *c)
+{
+	vinput_report_abs(vinput, ABS_MT_POSITION_X, c->x);
+	vinput_report_abs(vinput, ABS_MT_POSITION_Y, c->y);
+	if (c->z > 0)
+		vinput_report_abs(vinput, ABS_MT_PRESSURE, c->z);
+	else
+		vinput_report_abs(vinput, ABS_MT_DISTANCE, -c->z);
+}
+
+static int vinput_state_apply_contacts(struct vinput *vinput,
+				       const struct vinput_state *want)
+{
+	int i;
+	int active = 0;
+	struct input_dev *input = vinput->input;
+	struct vinput_state *cur = vinput->applied;
+
+	if (!test_bit(ABS_MT_POSITION_X, input->absbit) ||
+	    !memcmp(want->contacts, cur->contacts, sizeof(want->contacts)))
+		return 0;
+
+	/* type B: only the slots that changed */
+	if (input->mt) {
+		for (i = 0; i < input->mt->num_slots &&
+			    i < VINPUT_STATE_CONTACTS; i++) {
+			const struct vinput_contact *c = &want->contacts[i];
+
+			if (!memcmp(c, &cur->contacts[i], sizeof(*c)))
+				continue;
+			vinput_mt_slot(vinput, i);
+			vinput_report_abs(vinput, ABS_MT_TRACKING_ID,
+					  c->z ? c->id : -1);
+			if (c->z) {
+				vinput_report_abs(vinput, ABS_MT_TOOL_TYPE,
+						  MT_TOOL_FINGER);
+				vinput_state_report_contact(vinput, c);
+			}
+		}
+		return 1;
+	}
+
+	/* type A: the full set of contacts, an empty report lifts them all */
+	for (i = 0; i < VINPUT_STATE_CONTACTS; i++) {
+		if (!want->contacts[i].z)
+			continue;
+		vinput_state_report_contact(vinput, &want->contacts[i]);
+		vinput_mt_sync(vinput);
+		active++;
+	}
+	if (!active)
+		vinput_mt_sync(vinput);
+
+	return 1;
+}
+
+/*
+ * Called from the tick with vinput_lock held. Emits the transitions from
+ * the last applied state to the userspace desired state, if the latter
+ * changed and is not being written.
+ */
+static void vinput_state_apply(struct vinput *vinput)
+{
+	u32 seq;
+	int changed = 0;
+	unsigned long flags;
+	struct vinput_state *want = &vinput_state_snap;
+
+	seq = READ_ONCE(vinput->desired->seq);
+	if ((seq & 1) || seq == vinput->applied->seq)
+		return;
+	smp_rmb();
+	memcpy(want, vinput->desired, sizeof(*want));
+	smp_rmb();
+	if (READ_ONCE(vinput->desired->seq) != seq)
+		return;
+	want->seq = seq;
+
+	/* vts_mt is only registered once calibrated */
+	if (!device_is_registered(&vinput->input->dev))
+		return;
+
+	spin_lock_irqsave(&vinput->queue_lock, flags);
+	/* not in the middle of another frame, retried at the next tick */
+	if (vinput->queue_cur || vinput->frame_open)
+		goto out;
+
+	vinput_lat_begin(vinput, ktime_get_ns());
+	vinput_frame_begin(vinput);
+	changed |= vinput_state_apply_keys(vinput, want);
+	changed |= vinput_state_apply_pointer(vinput, want);
+	changed |= vinput_state_apply_contacts(vinput, want);
+	if (changed) {
+		vinput_frame_commit(vinput);
+		vinput_batch_done(vinput, vinput_batch_submit(vinput), 0);
+	}
+	vinput_lat_end(vinput);
+
+	memcpy(vinput->applied, want, sizeof(*want));
+out:
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+}
+
+static void vinput_state_tick(struct work_struct *work)
+{
+	int active = 0;
+	struct vinput *vinput;
+
+	spin_lock(&vinput_lock);
+	list_for_each_entry(vinput, &vinput_vdevices, list) {
+		if (!vinput->applied)
+			continue;
+		vinput_state_apply(vinput);
+		active = 1;
+	}
+	spin_unlock(&vinput_lock);
+
+	if (active)
+		schedule_delayed_work(&vinput_state_work,
+				      msecs_to_jiffies(max(state_tick_ms, 1U)));
+}
+
+static int vinput_state_enable(struct vinput *vinput)
+{
+	unsigned long page;
+	struct vinput_state *applied;
+
+	if (vinput->desired)
+		return 0;
+
+	page = get_zeroed_page(GFP_KERNEL);
+	applied = kzalloc(sizeof(*applied), GFP_KERNEL);
+	if (!page || !applied) {
+		free_page(page);
+		kfree(applied);
+		return -ENOMEM;
+	}
+
+	spin_lock(&vinput_lock);
+	if (!vinput->desired) {
+		vinput->desired = (struct vinput_state *)page;
+		vinput->applied = applied;
+		page = 0;
+		applied = NULL;
+	}
+	spin_unlock(&vinput_lock);
+
+	free_page(page);
+	kfree(applied);
+
+	schedule_delayed_work(&vinput_state_work,
+			      msecs_to_jiffies(max(state_tick_ms, 1U)));
+
+	return 0;
+}
+
+static void vinput_state_disable(struct vinput *vinput)
+{
+	spin_lock(&vinput_lock);
+	kfree(vinput->applied);
+	vinput->applied = NULL;
+	spin_unlock(&vinput_lock);
+}
+
+/*
+ * Lazy registration. With lazy_register set, the input device of a new
+ * vinput device is only registered on its first use: open of /dev/vinputX
+ * or records sent to it through the control node. Until then, consumers
+ * of input devices do not see it at all. Devices created in bulk mode are
+ * held back the same way until the bulk is released.
+ */
+int vinput_register_input(struct vinput *vinput)
+{
+	int err = 0;
+
+	mutex_lock(&vinput->input_lock);
+	if ((lazy_register && !vinput->input_used) || vinput->uevent_deferred) {
+		vinput->input_state = VINPUT_INPUT_PENDING;
+	} else {
+		err = input_register_device(vinput->input);
+		if (!err)
+			vinput->input_state = VINPUT_INPUT_REGISTERED;
+	}
+	mutex_unlock(&vinput->input_lock);
+
+	return err;
+}
+EXPORT_SYMBOL(vinput_register_input);
+
+/*
+ * register a pending input device, may sleep. One not set up yet (vts_mt
+ * before calibration) is registered by vinput_register_input() right away.
+ */
+static int vinput_input_ensure(struct vinput *vinput)
+{
+	int err = 0;
+	int state = READ_ONCE(vinput->input_state);
+
+	might_sleep();
+
+	if (state != VINPUT_INPUT_PENDING && state != VINPUT_INPUT_NONE)
+		return 0;
+
+	mutex_lock(&vinput->input_lock);
+	if (vinput->input_state == VINPUT_INPUT_PENDING) {
+		err = input_register_device(vinput->input);
+		if (!err)
+			vinput->input_state = VINPUT_INPUT_REGISTERED;
+	} else if (vinput->input_state == VINPUT_INPUT_NONE) {
+		vinput->input_used = 1;
+	}
+	mutex_unlock(&vinput->input_lock);
+
+	return err;
+}
+
+/*
+ * Once released, the input device is gone for the fds and in-kernel users
+ * still holding the vinput device. They check input_state under input_lock
+ * before touching vinput->input.
+ */
+static void vinput_input_release(struct vinput *vinput)
+{
+	mutex_lock(&vinput->input_lock);
+	if (vinput->input_state == VINPUT_INPUT_REGISTERED)
+		input_unregister_device(vinput->input);
+	else if (vinput->input_state != VINPUT_INPUT_GONE)
+		input_free_device(vinput->input);
+	vinput->input_state = VINPUT_INPUT_GONE;
+	mutex_unlock(&vinput->input_lock);
+}
+
+static int vinput_open(struct inode *inode, struct file *file)
+{
+	int err;
+	struct vinput *vinput = NULL;
+	struct vinput_file *vfile;
+
+	if (iminor(inode) == VINPUT_CTL_MINOR) {
+		replace_fops(file, &vinput_ctl_fops);
+		return file->f_op->open(inode, file);
+	}
+
+	/* the fd keeps the device, unexported or not, until it is closed */
+	vinput = vinput_get(iminor(inode));
+	if (IS_ERR(vinput))
+		return PTR_ERR(vinput);
+
+	err = vinput_input_ensure(vinput);
+	if (err)
+		goto fail;
+
+	vfile = kzalloc(sizeof(struct vinput_file), GFP_KERNEL);
+	if (!vfile) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	vfile->vinput = vinput;
+	vfile->format = VINPUT_FORMAT_TEXT;
+	mutex_init(&vfile->lock);
+	file->private_data = vfile;
+
+	return 0;
+fail:
+	vinput_put(vinput);
+	return err;
+}
+
+static int vinput_release(struct inode *inode, struct file *file)
+{
+	struct vinput_file *vfile = file->private_data;
+
+	if (vfile->stream)
+		vinput_stream_close(vfile->vinput, vfile->stream);
+	vinput_put(vfile->vinput);
+	kfree(vfile);
+
+	return 0;
+}
+
+static ssize_t vinput_read(struct file *file, char __user *buffer,
+			   size_t count, loff_t *offset)
+{
+	int len;
+	char buff[VINPUT_MAX_LEN + 1];
+	struct vinput_file *vfile = file->private_data;
+	struct vinput *vinput = vfile->vinput;
+
+	len = vinput->type->ops->read(vinput, buff, count);
+
+	if (*offset > len)
+		count = 0;
+	else if (count + *offset > VINPUT_MAX_LEN)
+		count = len - *offset;
+
+	if (copy_to_user(buffer, buff + *offset, count))
+		count = -EFAULT;
+
+	*offset += count;
+
+	return count;
+}
+
+#define VINPUT_STREAM_CHUNK	16
+
+/*
+ * Rate limits and back-pressure of a direct write. Such writes cannot be
+ * queued, the queue rate mode blocks them.
+ */
+static int vinput_send_wait(struct vinput *vinput, int nonblock)
+{
+	int ret;
+
+	ret = vinput_rate_wait(vinput, nonblock);
+	if (ret < 0)
+		return ret;
+	if (ret == VINPUT_RATE_DROPPED) {
+		vinput_rate_drop(vinput);
+		return ret;
+	}
+
+	return vinput_flow_wait(vinput, nonblock);
+}
+
+/* emit records of one device, pending tells whether a frame is open */
+static int vinput_emit_records(struct vinput *vinput,
+			       const struct vinput_record *recs, int n,
+			       int *pending)
+{
+	int i;
+	int err;
+	int was = *pending;
+	int resume = 0;
+	unsigned long flags;
+
+	for (i = 0; i < n; i++) {
+		err = vinput_record_check(vinput, &recs[i]);
+		if (err)
+			return err;
+	}
+
+	spin_lock_irqsave(&vinput->queue_lock, flags);
+	if (vinput->type->ops->send_batch) {
+		if (!was) {
+			vinput_queue_cut(vinput);
+			vinput->frame_open++;
+		}
+		err = vinput->type->ops->send_batch(vinput, recs, n);
+		if (err < 0) {
+			if (!was)
+				resume = vinput_direct_close(vinput);
+			goto out;
+		}
+		err = 0;
+		*pending = recs[n - 1].type != EV_SYN ||
+			   recs[n - 1].code != SYN_REPORT;
+		if (!*pending)
+			resume = vinput_direct_close(vinput);
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!*pending)
+			vinput_direct_begin(vinput);
+		if (recs[i].type == EV_SYN && recs[i].code == SYN_REPORT) {
+			resume |= vinput_direct_commit(vinput);
+			*pending = 0;
+			continue;
+		}
+		vinput_event(vinput, recs[i].type, recs[i].code,
+			     recs[i].value);
+		*pending = 1;
+	}
+	err = 0;
+out:
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+
+	if (resume)
+		vinput_queue_resume(vinput);
+
+	return err;
+}
+
+/*
+ * Record format: a write is an array of struct vinput_record (rec.id is
+ * ignored) making up one batch, the last frame being synced at the end.
+ */
+static ssize_t vinput_write_records(struct file *file,
+				    const char __user *buffer, size_t count)
+{
+	u64 seq;
+	int n;
+	int err;
+	int pending = 0;
+	size_t done = 0;
+	struct vinput_file *vfile = file->private_data;
+	struct vinput *vinput = vfile->vinput;
+	struct vinput_record recs[VINPUT_STREAM_CHUNK];
+	u64 stamp = ktime_get_ns();
+
+	if (!count || count % sizeof(struct vinput_record))
+		return -EINVAL;
+
+	mutex_lock(&vinput->input_lock);
+	if (vinput->input_state == VINPUT_INPUT_GONE) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	err = vinput_send_wait(vinput, file->f_flags & O_NONBLOCK);
+	if (err < 0)
+		goto out;
+	if (err == VINPUT_RATE_DROPPED) {
+		done = count;
+		goto out;
+	}
+
+	mutex_lock(&vfile->lock);
+	seq = vinput_batch_submit(vinput);
+	vinput_lat_begin(vinput, stamp);
+	while (done < count) {
+		n = min_t(size_t, (count - done) / sizeof(struct vinput_record),
+			  VINPUT_STREAM_CHUNK);
+		if (copy_from_user(recs, buffer + done,
+				   n * sizeof(struct vinput_record))) {
+			err = -EFAULT;
+			break;
+		}
+
+		err = vinput_emit_records(vinput, recs, n, &pending);
+		if (err)
+			break;
+		done += n * sizeof(struct vinput_record);
+	}
+	if (pending)
+		vinput_direct_end(vinput);
+	vinput_lat_end(vinput);
+	vinput_batch_done(vinput, seq, err);
+	mutex_unlock(&vfile->lock);
+out:
+	mutex_unlock(&vinput->input_lock);
+
+	return done ? done : err;
+}
+
+/*
+ * In-kernel producers. vinput_get takes a reference on a device by id
+ * and on the module of its type, vinput_inject emits a batch of records
+ * into it with the same checks, rate limits, back-pressure and accounting
+ * as a record format write. Like the device fd writes, it holds the input
+ * device throughout, so that a device being unexported fails with -ENODEV
+ * rather than going away underneath. The waits are bounded, teardown is
+ * only delayed by them.
+ */
+struct vinput *vinput_get(long id)
+{
+	struct vinput *vinput;
+
+	spin_lock(&vinput_lock);
+	list_for_each_entry(vinput, &vinput_vdevices, list) {
+		if (vinput->id != id)
+			continue;
+		/* the type is only unloaded once its devices are detached */
+		if (!try_module_get(vinput->type->owner))
+			break;
+		get_device(&vinput->dev);
+		spin_unlock(&vinput_lock);
+		return vinput;
+	}
+	spin_unlock(&vinput_lock);
+
+	return ERR_PTR(-ENODEV);
+}
+EXPORT_SYMBOL(vinput_get);
+
+void vinput_put(struct vinput *vinput)
+{
+	struct module *owner = vinput->type->owner;
+
+	put_device(&vinput->dev);
+	module_put(owner);
+}
+EXPORT_SYMBOL(vinput_put);
+
+/* returns the number of records consumed, may sleep */
+int vinput_inject(struct vinput *vinput, const struct vinput_record *recs,
+		  int n, unsigned int flags)
+{
+	u64 seq;
+	int err;
+	int pending = 0;
+	u64 stamp = ktime_get_ns();
+
+	if (n <= 0 || flags & ~VINPUT_INJECT_NONBLOCK)
+		return -EINVAL;
+
+	err = vinput_input_ensure(vinput);
+	if (err)
+		return err;
+
+	mutex_lock(&vinput->input_lock);
+	if (vinput->input_state != VINPUT_INPUT_REGISTERED) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	err = vinput_send_wait(vinput, flags & VINPUT_INJECT_NONBLOCK);
+	if (err < 0)
+		goto out;
+	if (err == VINPUT_RATE_DROPPED) {
+		err = 0;
+		goto out;
+	}
+
+	seq = vinput_batch_submit(vinput);
+	vinput_lat_begin(vinput, stamp);
+	err = vinput_emit_records(vinput, recs, n, &pending);
+	if (pending)
+		vinput_direct_end(vinput);
+	vinput_lat_end(vinput);
+	vinput_batch_done(vinput, seq, err);
+out:
+	mutex_unlock(&vinput->input_lock);
+
+	return err ? err : n;
+}
+EXPORT_SYMBOL(vinput_inject);
+
+/*
+ * Timed format: the records of a write are queued on the stream of the fd
+ * and make up one batch, as on the control node.
+ */
+static ssize_t vinput_write_timed(struct file *file, const char __user *buffer,
+				  size_t count)
+{
+	int i, n;
+	int err = 0;
+	int pending = 0;
+	size_t done = 0;
+	struct vinput_qevent ev = { 0 };
+	struct vinput_file *vfile = file->private_data;
+	struct vinput *vinput = vfile->vinput;
+	struct vinput_timed_record recs[VINPUT_STREAM_CHUNK];
+
+	if (count % sizeof(struct vinput_timed_record))
+		return -EINVAL;
+
+	/* a stopped queue wakes the writer before the input is released */
+	mutex_lock(&vinput->input_lock);
+	mutex_lock(&vfile->lock);
+	if (!vfile->stream)
+		err = -EINVAL;
+	else if (vinput->input_state == VINPUT_INPUT_GONE)
+		err = -ENODEV;
+	while (!err && done < count) {
+		n = min_t(size_t,
+			  (count - done) / sizeof(struct vinput_timed_record),
+			  VINPUT_STREAM_CHUNK);
+		if (copy_from_user(recs, buffer + done,
+				   n * sizeof(struct vinput_timed_record))) {
+			err = -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			err = recs[i].flags ? -EINVAL :
+			      vinput_record_check(vinput, &recs[i].rec);
+			if (err)
+				break;
+			ev.time = recs[i].time;
+			ev.type = recs[i].rec.type;
+			ev.code = recs[i].rec.code;
+			ev.value = recs[i].rec.value;
+			err = vinput_queue_push_wait(vinput, vfile->stream, &ev,
+						     VINPUT_QUEUE_RESERVE,
+						     file->f_flags & O_NONBLOCK);
+			if (err)
+				break;
+			pending = ev.type != EV_SYN || ev.code != SYN_REPORT;
+			done += sizeof(struct vinput_timed_record);
+		}
+	}
+
+	if (done)
+		vinput_queue_close(vinput, vfile->stream, pending,
+				   vinput_batch_submit(vinput));
+	mutex_unlock(&vfile->lock);
+	mutex_unlock(&vinput->input_lock);
+
+	return done ? done : err;
+}
+
+static int vinput_set_format(struct vinput_file *vfile, unsigned long format)
+{
+	int err = 0;
+	struct vinput_stream *stream;
+
+	if (format != VINPUT_FORMAT_TEXT && format != VINPUT_FORMAT_TIMED &&
+	    format != VINPUT_FORMAT_RECORD)
+		return -EINVAL;
+
+	mutex_lock(&vfile->lock);
+	if (format == VINPUT_FORMAT_TIMED && !vfile->stream) {
+		stream = vinput_stream_open(vfile->vinput);
+		if (IS_ERR(stream)) {
+			err = PTR_ERR(stream);
+			goto out;
+		}
+		vfile->stream = stream;
+	} else if (format != VINPUT_FORMAT_TIMED && vfile->stream) {
+		vinput_stream_close(vfile->vinput, vfile->stream);
+		vfile->stream = NULL;
+	}
+	vfile->format = format;
+out:
+	mutex_unlock(&vfile->lock);
+
+	return err;
+}
+
+static ssize_t vinput_write(struct file *file, const char __user *buffer,
+			    size_t count, loff_t *offset)
+{
+	u64 seq;
+	ssize_t ret;
+	int resume;
+	unsigned long flags;
+	char buff[VINPUT_MAX_LEN + 1];
+	struct vinput_file *vfile = file->private_data;
+	struct vinput *vinput = vfile->vinput;
+	u64 stamp = ktime_get_ns();
+
+	if (vfile->format == VINPUT_FORMAT_TIMED)
+		return vinput_write_timed(file, buffer, count);
+	if (vfile->format == VINPUT_FORMAT_RECORD)
+		return vinput_write_records(file, buffer, count);
+
+	memset(buff, 0, sizeof(char) * (VINPUT_MAX_LEN + 1));
+
+	if (count > VINPUT_MAX_LEN) {
+		dev_warn(&vinput->dev, "Too long. %d bytes allowed\n", VINPUT_MAX_LEN);
+		return -EINVAL;
+	}
+
+	if (copy_from_user(buff, buffer, count))
+		return -EFAULT;
+
+	mutex_lock(&vinput->input_lock);
+	if (vinput->input_state == VINPUT_INPUT_GONE) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	ret = vinput_send_wait(vinput, file->f_flags & O_NONBLOCK);
+	if (ret < 0)
+		goto out;
+	if (ret == VINPUT_RATE_DROPPED) {
+		ret = count;
+		goto out;
+	}
+
+	seq = vinput_batch_submit(vinput);
+	vinput_lat_begin(vinput, stamp);
+	/* a text write is a whole frame, emitted in one go */
+	spin_lock_irqsave(&vinput->queue_lock, flags);
+	vinput_queue_cut(vinput);
+	vinput->frame_open++;
+	ret = vinput->type->ops->send(vinput, buff, count);
+	resume = vinput_direct_close(vinput);
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+	if (resume)
+		vinput_queue_resume(vinput);
+	vinput_lat_end(vinput);
+	vinput_batch_done(vinput, seq, ret < 0 ? ret : 0);
+out:
+	mutex_unlock(&vinput->input_lock);
+
+	return ret;
+}
+
+static int vinput_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int err;
+	struct vinput_file *vfile = file->private_data;
+	struct vinput *vinput = vfile->vinput;
+
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+
+	switch (vma->vm_pgoff) {
+	case VINPUT_MMAP_DESIRED:
+		err = vinput_state_enable(vinput);
+		if (err)
+			return err;
+		return vm_insert_page(vma, vma->vm_start,
+				      virt_to_page(vinput->desired));
+	case VINPUT_MMAP_STATE:
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		vma->vm_flags &= ~VM_MAYWRITE;
+		return vm_insert_page(vma, vma->vm_start,
+				      virt_to_page(vinput->observed));
+	default:
+		return -EINVAL;
+	}
+}
+
+int vinput_get_info(struct vinput *vinput, struct vinput_info *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->version = VINPUT_ABI_VERSION;
+	info->formats = (1 << VINPUT_FORMAT_RECORD) |
+			(1 << VINPUT_FORMAT_TIMED) |
+			(1 << VINPUT_FORMAT_TEXT);
+	info->max_text = VINPUT_MAX_LEN;
+	info->max_txn = VINPUT_TXN_MAX;
+	info->max_urgent = VINPUT_URGENT_MAX;
+	info->queue_depth = kfifo_size(&vinput->queue.fifo);
+	info->max_x = -1;
+	info->max_y = -1;
+	info->max_z = -1;
+	info->max_points = -1;
+
+	mutex_lock(&vinput->input_lock);
+	if (vinput->input_state == VINPUT_INPUT_GONE) {
+		mutex_unlock(&vinput->input_lock);
+		return -ENODEV;
+	}
+	info->batch_size = vinput->input->hint_events_per_packet;
+	info->evbit = vinput->input->evbit[0];
+	if (vinput->input_state == VINPUT_INPUT_REGISTERED)
+		info->flags |= VINPUT_INFO_REGISTERED;
+	strlcpy(info->type, vinput->type->name, sizeof(info->type));
+	if (vinput->type->ops->info)
+		vinput->type->ops->info(vinput, info);
+	mutex_unlock(&vinput->input_lock);
+
+	return 0;
+}
+EXPORT_SYMBOL(vinput_get_info);
+
+static int vinput_ioctl_get_info(struct vinput *vinput,
+				 struct vinput_info __user *arg)
+{
+	int err;
+	struct vinput_info info;
+
+	err = vinput_get_info(vinput, &info);
+	if (err)
+		return err;
+
+	if (copy_to_user(arg, &info, sizeof(info)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long vinput_ioctl(struct file *file, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct vinput_file *vfile = file->private_data;
+	struct vinput *vinput = vfile->vinput;
+	struct vinput_seq seq;
+
+	switch (cmd) {
+	case VINPUT_IOC_SET_EVENTFD:
+		return vinput_set_eventfd(vinput, (int)arg);
+	case VINPUT_IOC_GET_SEQ:
+		seq.submitted = atomic64_read(&vinput->submitted);
+		seq.completed = READ_ONCE(vinput->completed);
+		seq.failed = READ_ONCE(vinput->failed);
+		if (copy_to_user((void __user *)arg, &seq, sizeof(seq)))
+			return -EFAULT;
+		return 0;
+	case VINPUT_IOC_SET_FORMAT:
+		return vinput_set_format(vfile, arg);
+	case VINPUT_IOC_GET_INFO:
+		return vinput_ioctl_get_info(vinput,
+					     (struct vinput_info __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* fsync waits for the playback queue to drain */
+static int vinput_fsync(struct file *file, loff_t start, loff_t end,
+			int datasync)
+{
+	struct vinput_file *vfile = file->private_data;
+
+	return vinput_queue_drain(vfile->vinput);
+}
+
+static unsigned int vinput_poll(struct file *file, poll_table *wait)
+{
+	struct vinput_file *vfile = file->private_data;
+	struct vinput *vinput = vfile->vinput;
+	struct vinput_stream *stream = vfile->stream ?: &vinput->queue;
+
+	poll_wait(file, &vinput->queue_wait, wait);
+
+	if (vinput_queue_room(stream, VINPUT_QUEUE_RESERVE))
+		return POLLOUT | POLLWRNORM;
+	return 0;
+}
+
+static const struct file_operations vinput_fops = {
+	.owner = THIS_MODULE,
+	.open = vinput_open,
+	.release = vinput_release,
+	.read = vinput_read,
+	.write = vinput_write,
+	.mmap = vinput_mmap,
+	.unlocked_ioctl = vinput_ioctl,
+	.compat_ioctl = vinput_ioctl,
+	.fsync = vinput_fsync,
+	.poll = vinput_poll,
+};
+
+struct vinput_mux {
+	struct vinput *dev[VINPUT_MINORS];	/* referenced, see lookup */
+	int flow;		/* apply back-pressure */
+	int txn;		/* under vinput_txn_lock, cannot sleep */
+	int nonblock;
+	u64 stamp;		/* injection time */
+	DECLARE_BITMAP(pending, VINPUT_MINORS);	/* queued, not synced yet */
+	DECLARE_BITMAP(open, VINPUT_MINORS);	/* direct frame open */
+	DECLARE_BITMAP(touched, VINPUT_MINORS);	/* part of the batch */
+	DECLARE_BITMAP(dropped, VINPUT_MINORS);	/* frame over the rate limit */
+	DECLARE_BITMAP(paced, VINPUT_MINORS);	/* queued by their rate limit */
+};
+
+static void vinput_mux_init(struct vinput_mux *mux)
+{
+	memset(mux->dev, 0, sizeof(mux->dev));
+	mux->flow = 0;
+	mux->txn = 0;
+	mux->nonblock = 0;
+	mux->stamp = ktime_get_ns();
+	bitmap_zero(mux->pending, VINPUT_MINORS);
+	bitmap_zero(mux->open, VINPUT_MINORS);
+	bitmap_zero(mux->touched, VINPUT_MINORS);
+	bitmap_zero(mux->dropped, VINPUT_MINORS);
+	bitmap_zero(mux->paced, VINPUT_MINORS);
+}
+
+/*
+ * Apply the rate limits and back-pressure of a device to the frame that
+ * starts, a frame over the limit in drop mode is dropped as a whole.
+ */
+static int vinput_mux_wait(struct vinput_mux *mux, struct vinput *vinput)
+{
+	int err;
+
+	if (vinput->rate.mode != VINPUT_RATE_QUEUE) {
+		err = vinput_rate_wait(vinput, mux->nonblock);
+		if (err < 0)
+			return err;
+		if (err == VINPUT_RATE_DROPPED) {
+			vinput_rate_drop(vinput);
+			set_bit(vinput->id, mux->dropped);
+			return 0;
+		}
+	}
+
+	return vinput_flow_wait(vinput, mux->nonblock);
+}
+
+static int vinput_mux_push(struct vinput_mux *mux, struct vinput *vinput,
+			   const struct vinput_timed_record *trec,
+			   int nonblock);
+
+/*
+ * The first record for a device takes a reference on it, the write may
+ * sleep between its records. vinput_mux_release() drops them all.
+ */
+static struct vinput *vinput_mux_lookup(struct vinput_mux *mux,
+					const struct vinput_record *rec)
+{
+	int err;
+	struct vinput *vinput;
+
+	if (rec->id >= VINPUT_MINORS)
+		return ERR_PTR(-ENODEV);
+
+	vinput = mux->dev[rec->id];
+	if (!vinput) {
+		vinput = vinput_get(rec->id);
+		if (IS_ERR(vinput))
+			return vinput;
+		mux->dev[rec->id] = vinput;
+		/* transactions are resolved when staged */
+		if (!mux->txn) {
+			err = vinput_input_ensure(vinput);
+			if (err)
+				return ERR_PTR(err);
+		}
+	}
+
+	set_bit(vinput->id, mux->touched);
+
+	return vinput;
+}
+
+static void vinput_mux_release(struct vinput_mux *mux)
+{
+	int id;
+
+	for (id = 0; id < VINPUT_MINORS; id++) {
+		if (mux->dev[id])
+			vinput_put(mux->dev[id]);
+		mux->dev[id] = NULL;
+	}
+}
+
+/*
+ * Outside a transaction the input device is checked and used under
+ * input_lock. A transaction holds vinput_txn_lock instead, which keeps
+ * the devices it validated registered.
+ */
+static int vinput_mux_input_lock(struct vinput_mux *mux, struct vinput *vinput)
+{
+	if (mux->txn)
+		return 0;
+
+	mutex_lock(&vinput->input_lock);
+	if (vinput->input_state != VINPUT_INPUT_REGISTERED) {
+		mutex_unlock(&vinput->input_lock);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+static void vinput_mux_input_unlock(struct vinput_mux *mux,
+				    struct vinput *vinput)
+{
+	if (!mux->txn)
+		mutex_unlock(&vinput->input_lock);
+}
+
+static int __vinput_mux_dispatch(struct vinput_mux *mux, struct vinput *vinput,
+				 const struct vinput_record *rec)
+{
+	int err;
+	int resume = 0;
+	unsigned long flags;
+
+	err = vinput_record_check(vinput, rec);
+	if (err)
+		return err;
+
+	if (mux->flow && !test_bit(vinput->id, mux->pending) &&
+	    !test_bit(vinput->id, mux->open) &&
+	    !test_bit(vinput->id, mux->dropped)) {
+		err = vinput_mux_wait(mux, vinput);
+		if (err)
+			return err;
+	}
+
+	if (test_bit(vinput->id, mux->dropped)) {
+		if (rec->type == EV_SYN && rec->code == SYN_REPORT)
+			clear_bit(vinput->id, mux->dropped);
+		return 0;
+	}
+
+	if (mux->flow && vinput->rate.mode == VINPUT_RATE_QUEUE &&
+	    (vinput->rate.events.rate || vinput->rate.frames.rate ||
+	     vinput->rate.group)) {
+		struct vinput_timed_record trec = {
+			.time = vinput_rate_pace(vinput, rec),
+			.rec = *rec,
+		};
+
+		/* the rate mode changed in the middle of a frame */
+		if (test_and_clear_bit(vinput->id, mux->open))
+			vinput_direct_end(vinput);
+		set_bit(vinput->id, mux->paced);
+		return vinput_mux_push(mux, vinput, &trec, mux->nonblock);
+	}
+
+	vinput_lat_begin(vinput, mux->stamp);
+	spin_lock_irqsave(&vinput->queue_lock, flags);
+	if (!test_and_set_bit(vinput->id, mux->open))
+		vinput_direct_begin(vinput);
+	if (rec->type == EV_SYN && rec->code == SYN_REPORT) {
+		resume = vinput_direct_commit(vinput);
+		clear_bit(vinput->id, mux->open);
+	} else {
+		vinput_event(vinput, rec->type, rec->code, rec->value);
+	}
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+
+	if (resume)
+		vinput_queue_resume(vinput);
+
+	return 0;
+}
+
+static int vinput_mux_dispatch(struct vinput_mux *mux,
+			       const struct vinput_record *rec)
+{
+	int err;
+	struct vinput *vinput = vinput_mux_lookup(mux, rec);
+
+	if (IS_ERR(vinput))
+		return PTR_ERR(vinput);
+
+	err = vinput_mux_input_lock(mux, vinput);
+	if (err)
+		return err;
+	err = __vinput_mux_dispatch(mux, vinput, rec);
+	vinput_mux_input_unlock(mux, vinput);
+
+	return err;
+}
+
+static void vinput_mux_sync_one(struct vinput_mux *mux, struct vinput *vinput)
+{
+	if (test_and_clear_bit(vinput->id, mux->open))
+		vinput_direct_end(vinput);
+}
+
+static void vinput_mux_queue_close_one(struct vinput_mux *mux,
+				       struct vinput *vinput);
+
+/* sync what is left and complete one batch on every touched device */
+static void vinput_mux_sync(struct vinput_mux *mux)
+{
+	unsigned long id;
+	struct vinput *vinput;
+
+	for_each_set_bit(id, mux->touched, VINPUT_MINORS) {
+		vinput = mux->dev[id];
+		vinput_mux_sync_one(mux, vinput);
+		if (test_bit(id, mux->paced)) {
+			vinput_mux_queue_close_one(mux, vinput);
+			continue;
+		}
+		vinput_lat_end(vinput);
+		vinput_batch_done(vinput, vinput_batch_submit(vinput), 0);
+	}
+}
+
+static int vinput_mux_push(struct vinput_mux *mux, struct vinput *vinput,
+			   const struct vinput_timed_record *trec,
+			   int nonblock)
+{
+	int err;
+	struct vinput_qevent ev = {
+		.time = trec->time,
+		.type = trec->rec.type,
+		.code = trec->rec.code,
+		.value = trec->rec.value,
+	};
+
+	err = vinput_queue_push_wait(vinput, &vinput->queue, &ev,
+				     VINPUT_QUEUE_RESERVE, nonblock);
+	if (err)
+		return err;
+
+	if (ev.type == EV_SYN && ev.code == SYN_REPORT)
+		clear_bit(vinput->id, mux->pending);
+	else
+		set_bit(vinput->id, mux->pending);
+
+	return 0;
+}
+
+static int vinput_mux_queue(struct vinput_mux *mux,
+			    const struct vinput_timed_record *trec,
+			    int nonblock)
+{
+	int err;
+	struct vinput *vinput;
+
+	if (trec->flags)
+		return -EINVAL;
+
+	vinput = vinput_mux_lookup(mux, &trec->rec);
+	if (IS_ERR(vinput))
+		return PTR_ERR(vinput);
+
+	err = vinput_mux_input_lock(mux, vinput);
+	if (err)
+		return err;
+	err = vinput_record_check(vinput, &trec->rec);
+	if (!err)
+		err = vinput_mux_push(mux, vinput, trec, nonblock);
+	vinput_mux_input_unlock(mux, vinput);
+
+	return err;
+}
+
+/* queue the closing sync and the batch marker of a device, never blocks */
+static void vinput_mux_queue_close_one(struct vinput_mux *mux,
+				       struct vinput *vinput)
+{
+	vinput_queue_close(vinput, &vinput->queue,
+			   test_and_clear_bit(vinput->id, mux->pending),
+			   vinput_batch_submit(vinput));
+}
+
+static void vinput_mux_queue_close(struct vinput_mux *mux)
+{
+	unsigned long id;
+	struct vinput *vinput;
+
+	for_each_set_bit(id, mux->touched, VINPUT_MINORS)
+		vinput_mux_queue_close_one(mux, mux->dev[id]);
+}
+
+static int vinput_ctl_open(struct inode *inode, struct file *file)
+{
+	struct vinput_ctl_file *ctl = kzalloc(sizeof(*ctl), GFP_KERNEL);
+
+	if (!ctl)
+		return -ENOMEM;
+
+	mutex_init(&ctl->lock);
+	file->private_data = ctl;
+
+	return 0;
+}
+
+static int vinput_ctl_release(struct inode *inode, struct file *file)
+{
+	struct vinput_ctl_file *ctl = file->private_data;
+
+	kfree(ctl->staged);
+	kfree(ctl);
+
+	return 0;
+}
+
+/* the input devices are registered here, the commit cannot sleep */
+static int vinput_txn_stage(struct vinput_ctl_file *ctl,
+			    const struct vinput_record *rec)
+{
+	int err;
+	struct vinput *vinput;
+
+	vinput = vinput_get_vdevice_by_id(rec->id);
+	if (IS_ERR(vinput))
+		return PTR_ERR(vinput);
+
+	err = vinput_input_ensure(vinput);
+	if (err)
+		return err;
+
+	err = vinput_record_check(vinput, rec);
+	if (err)
+		return err;
+
+	if (ctl->count >= VINPUT_TXN_MAX)
+		return -ENOSPC;
+
+	ctl->staged[ctl->count++] = *rec;
+
+	return 0;
+}
+
+static int vinput_txn_commit(struct vinput_ctl_file *ctl)
+{
+	int err = 0;
+	unsigned int i;
+	struct vinput *vinput;
+	struct vinput *last = NULL;
+	struct vinput_mux mux;
+	const struct vinput_record *rec;
+
+	vinput_mux_init(&mux);
+	mux.txn = 1;
+
+	/* no preemption between the frames of the different devices */
+	spin_lock(&vinput_txn_lock);
+
+	/*
+	 * Unexport takes the lock too: the devices found here stay until the
+	 * commit is over, so we emit all or none.
+	 */
+	for (i = 0; i < ctl->count; i++) {
+		vinput = vinput_mux_lookup(&mux, &ctl->staged[i]);
+		if (IS_ERR(vinput) || READ_ONCE(vinput->input_state) !=
+				      VINPUT_INPUT_REGISTERED) {
+			err = -ENODEV;
+			goto out;
+		}
+	}
+	bitmap_zero(mux.touched, VINPUT_MINORS);
+
+	for (i = 0; i < ctl->count; i++) {
+		rec = &ctl->staged[i];
+		if (last && last->id != rec->id)
+			vinput_mux_sync_one(&mux, last);
+		err = vinput_mux_dispatch(&mux, rec);
+		if (err)
+			break;
+		last = mux.dev[rec->id];
+	}
+	vinput_mux_sync(&mux);
+out:
+	spin_unlock(&vinput_txn_lock);
+
+	/* the devices stay listed while the lock is held, put after it */
+	vinput_mux_release(&mux);
+
+	return err;
+}
+
+static ssize_t vinput_ctl_write_timed(struct file *file,
+				      const char __user *buffer, size_t count)
+{
+	int i, n;
+	int err = 0;
+	size_t done = 0;
+	struct vinput_mux mux;
+	struct vinput_ctl_file *ctl = file->private_data;
+	struct vinput_timed_record recs[VINPUT_MUX_CHUNK / 2];
+
+	if (count % sizeof(struct vinput_timed_record))
+		return -EINVAL;
+
+	vinput_mux_init(&mux);
+
+	mutex_lock(&ctl->lock);
+	while (!err && done < count) {
+		n = min_t(size_t,
+			  (count - done) / sizeof(struct vinput_timed_record),
+			  ARRAY_SIZE(recs));
+		if (copy_from_user(recs, buffer + done,
+				   n * sizeof(struct vinput_timed_record))) {
+			err = -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			err = vinput_mux_queue(&mux, &recs[i],
+					       file->f_flags & O_NONBLOCK);
+			if (err)
+				break;
+			done += sizeof(struct vinput_timed_record);
+		}
+	}
+	vinput_mux_queue_close(&mux);
+	mutex_unlock(&ctl->lock);
+
+	vinput_mux_release(&mux);
+
+	return done ? done : err;
+}
+
+/*
+ * The control node takes an array of struct vinput_record. Records are
+ * dispatched in order to their device and every device left with
+ * unsynced events is synced once at the end of the write. Within a
+ * transaction the records are only validated and staged.
+ */
+static ssize_t vinput_ctl_write(struct file *file, const char __user *buffer,
+				size_t count, loff_t *offset)
+{
+	int i, n;
+	int err = 0;
+	size_t done = 0;
+	struct vinput_mux mux;
+	struct vinput_ctl_file *ctl = file->private_data;
+	struct vinput_record recs[VINPUT_MUX_CHUNK];
+
+	if (ctl->format == VINPUT_FORMAT_TIMED)
+		return vinput_ctl_write_timed(file, buffer, count);
+
+	if (count % sizeof(struct vinput_record))
+		return -EINVAL;
+
+	vinput_mux_init(&mux);
+	mux.flow = 1;
+	mux.nonblock = file->f_flags & O_NONBLOCK;
+
+	mutex_lock(&ctl->lock);
+	while (!err && done < count) {
+		n = min_t(size_t, (count - done) / sizeof(struct vinput_record),
+			  VINPUT_MUX_CHUNK);
+		if (copy_from_user(recs, buffer + done,
+				   n * sizeof(struct vinput_record))) {
+			err = -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (ctl->staging)
+				err = vinput_txn_stage(ctl, &recs[i]);
+			else
+				err = vinput_mux_dispatch(&mux, &recs[i]);
+			if (err)
+				break;
+			done += sizeof(struct vinput_record);
+		}
+	}
+	mutex_unlock(&ctl->lock);
+
+	vinput_mux_sync(&mux);
+	vinput_mux_release(&mux);
+
+	return done ? done : err;
+}
+
+/* fsync on the control node waits for every playback queue to drain */
+static int vinput_ctl_fsync(struct file *file, loff_t start, loff_t end,
+			    int datasync)
+{
+	int err;
+	long id;
+	struct vinput *vinput;
+
+	for (id = 0; id < VINPUT_MINORS; id++) {
+		vinput = vinput_get(id);
+		if (IS_ERR(vinput))
+			continue;
+		err = vinput_queue_drain(vinput);
+		vinput_put(vinput);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Priority lane. Urgent records are emitted under the queue lock of their
+ * device, so the playback timer cannot interleave queued events with them,
+ * and skip rate limits and back-pressure. A frame the queue was in the
+ * middle of is completed by the urgent frame.
+ */
+#define VINPUT_URGENT_FLAGS	(VINPUT_URGENT_FLUSH | VINPUT_URGENT_RELEASE_ALL)
+
+/* drop the queued events of every stream. queue_lock held */
+static void vinput_urgent_flush(struct vinput *vinput)
+{
+	struct vinput_stream *stream;
+
+	list_for_each_entry(stream, &vinput->streams, list)
+		vinput_stream_flush(vinput, stream);
+	vinput->queue_cur = NULL;
+}
+
+/* release the pressed keys and lift the contacts. queue_lock held */
+static void vinput_urgent_release(struct vinput *vinput)
+{
+	int i;
+	unsigned int code;
+	struct input_dev *input = vinput->input;
+
+	for_each_set_bit(code, input->key, KEY_CNT)
+		vinput_report_key(vinput, code, 0);
+
+	if (input->mt) {
+		for (i = 0; i < input->mt->num_slots; i++) {
+			if (!input_mt_is_active(&input->mt->slots[i]))
+				continue;
+			vinput_mt_slot(vinput, i);
+			vinput_report_abs(vinput, ABS_MT_TRACKING_ID, -1);
+		}
+	} else if (test_bit(ABS_MT_POSITION_X, input->absbit)) {
+		vinput_mt_sync(vinput);
+	}
+}
+
+/* the urgent frame, and the queued one it completes, are committed */
+static void vinput_urgent_commit(struct vinput *vinput)
+{
+	if (vinput->queue_cur)
+		vinput_queue_cut(vinput);
+	else
+		vinput_frame_commit(vinput);
+}
+
+static void vinput_urgent_end(struct vinput *vinput, int pending,
+			      unsigned long flags)
+{
+	int resume;
+
+	if (pending)
+		vinput_urgent_commit(vinput);
+	vinput_lat_end(vinput);
+	resume = vinput_queue_unhold(vinput);
+	spin_unlock_irqrestore(&vinput->queue_lock, flags);
+
+	if (resume)
+		vinput_queue_resume(vinput);
+	wake_up_interruptible(&vinput->queue_wait);
+	vinput_batch_done(vinput, vinput_batch_submit(vinput), 0);
+}
+
+static long vinput_ctl_urgent(struct vinput_urgent __user *arg)
+{
+	long err = 0;
+	int skip = 0;
+	int pending = 0;
+	unsigned int i;
+	unsigned long id;
+	unsigned long flags = 0;
+	u64 stamp = ktime_get_ns();
+	struct vinput_urgent req;
+	struct vinput_record *recs;
+	struct vinput *vinput = NULL;
+	struct vinput *devs[VINPUT_MINORS] = { NULL };
+	DECLARE_BITMAP(touched, VINPUT_MINORS);
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if ((req.flags & ~VINPUT_URGENT_FLAGS) || req.count > VINPUT_URGENT_MAX)
+		return -EINVAL;
+
+	recs = kmalloc_array(req.count, sizeof(struct vinput_record),
+			     GFP_KERNEL);
+	if (!recs)
+		return -ENOMEM;
+	if (copy_from_user(recs, (void __user *)(uintptr_t)req.records,
+			   req.count * sizeof(struct vinput_record))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	/* the devices are held until the end of the call */
+	for (i = 0; i < req.count; i++) {
+		if (recs[i].id >= VINPUT_MINORS) {
+			err = -ENODEV;
+			goto out;
+		}
+		vinput = devs[recs[i].id];
+		if (!vinput) {
+			vinput = vinput_get(recs[i].id);
+			if (IS_ERR(vinput)) {
+				err = -ENODEV;
+				goto out;
+			}
+			devs[recs[i].id] = vinput;
+			err = vinput_input_ensure(vinput);
+			if (err)
+				goto out;
+		}
+		mutex_lock(&vinput->input_lock);
+		if (vinput->input_state != VINPUT_INPUT_REGISTERED)
+			err = -ENODEV;
+		else
+			err = vinput_record_check(vinput, &recs[i]);
+		mutex_unlock(&vinput->input_lock);
+		if (err)
+			goto out;
+	}
+
+	vinput = NULL;
+	bitmap_zero(touched, VINPUT_MINORS);
+	for (i = 0; i < req.count; i++) {
+		if (!vinput || vinput->id != recs[i].id) {
+			if (vinput && !skip)
+				vinput_urgent_end(vinput, pending, flags);
+			pending = 0;
+
+			vinput = devs[recs[i].id];
+			spin_lock_irqsave(&vinput->queue_lock, flags);
+			/* unexported since, its input may be gone already */
+			skip = vinput->queue_stopped ||
+			       READ_ONCE(vinput->input_state) !=
+			       VINPUT_INPUT_REGISTERED;
+			if (skip) {
+				spin_unlock_irqrestore(&vinput->queue_lock,
+						       flags);
+				continue;
+			}
+
+			vinput_lat_begin(vinput, stamp);
+			/* a queued or direct frame in progress is begun */
+			pending = vinput->queue_cur || vinput->frame_open;
+			if (!test_and_set_bit(vinput->id, touched)) {
+				if (req.flags & VINPUT_URGENT_FLUSH)
+					vinput_urgent_flush(vinput);
+				if (req.flags & VINPUT_URGENT_RELEASE_ALL) {
+					if (!pending)
+						vinput_frame_begin(vinput);
+					vinput_urgent_release(vinput);
+					pending = 1;
+				}
+			}
+		}
+
+		if (skip)
+			continue;
+		if (!pending)
+			vinput_frame_begin(vinput);
+		if (recs[i].type == EV_SYN && recs[i].code == SYN_REPORT) {
+			vinput_urgent_commit(vinput);
+			pending = 0;
+		} else {
+			vinput_event(vinput, recs[i].type, recs[i].code,
+				     recs[i].value);
+			pending = 1;
+		}
+	}
+	if (vinput && !skip)
+		vinput_urgent_end(vinput, pending, flags);
+
+	/* the flushed devices no longer wait for the timer */
+	if (req.flags & VINPUT_URGENT_FLUSH)
+		for_each_set_bit(id, touched, VINPUT_MINORS)
+			vinput_sched_idle(devs[id]);
+out:
+	for (id = 0; id < VINPUT_MINORS; id++)
+		if (devs[id])
+			vinput_put(devs[id]);
+	kfree(recs);
+
+	return err;
+}
+
+static long vinput_ctl_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
+{
+	long err = 0;
+	struct vinput_ctl_file *ctl = file->private_data;
+
+	/* not behind ctl->lock, a writer may be blocked on a full queue */
+	if (cmd == VINPUT_IOC_URGENT)
+		return vinput_ctl_urgent((struct vinput_urgent __user *)arg);
+
+	mutex_lock(&ctl->lock);
+	switch (cmd) {
+	case VINPUT_IOC_TXN_BEGIN:
+		if (ctl->staging) {
+			err = -EBUSY;
+			break;
+		}
+		if (!ctl->staged) {
+			ctl->staged = kmalloc_array(VINPUT_TXN_MAX,
+						    sizeof(struct vinput_record),
+						    GFP_KERNEL);
+			if (!ctl->staged) {
+				err = -ENOMEM;
+				break;
+			}
+		}
+		ctl->count = 0;
+		ctl->staging = 1;
+		break;
+	case VINPUT_IOC_TXN_COMMIT:
+		if (!ctl->staging) {
+			err = -EINVAL;
+			break;
+		}
+		err = vinput_txn_commit(ctl);
+		ctl->staging = 0;
+		break;
+	case VINPUT_IOC_TXN_ABORT:
+		ctl->staging = 0;
+		break;
+	case VINPUT_IOC_SET_FORMAT:
+		if (ctl->staging || (arg != VINPUT_FORMAT_RECORD &&
+				     arg != VINPUT_FORMAT_TIMED)) {
+			err = -EINVAL;
+			break;
+		}
+		ctl->format = arg;
+		break;
+	default:
+		err = -ENOTTY;
+	}
+	mutex_unlock(&ctl->lock);
+
+	return err;
+}
+
+static const struct file_operations vinput_ctl_fops = {
+	.owner = THIS_MODULE,
+	.open = vinput_ctl_open,
+	.release = vinput_ctl_release,
+	.write = vinput_ctl_write,
+	.unlocked_ioctl = vinput_ctl_ioctl,
+	.compat_ioctl = vinput_ctl_ioctl,
+	.fsync = vinput_ctl_fsync,
+};
+
+/*
+ * The cache of a type holds struct vinput followed by the private data of
+ * the type. Devices may be released after their type is unregistered, so
+ * each of them keeps a reference on the cache, destroyed with the last.
+ */
+struct vinput_cache {
+	struct kmem_cache *cache;
+	struct kref ref;
+	char name[24];
+};
+
+static struct vinput_cache *vinput_cache_create(struct vinput_device *type)
+{
+	struct vinput_cache *cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+
+	if (!cache)
+		return NULL;
+
+	kref_init(&cache->ref);
+	snprintf(cache->name, sizeof(cache->name), DRIVER_NAME "_%s",
+		 type->name);
+	cache->cache = kmem_cache_create(cache->name,
+					 sizeof(struct vinput) + type->priv_size,
+					 0, 0, NULL);
+	if (!cache->cache) {
+		kfree(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+static void vinput_cache_release(struct kref *ref)
+{
+	struct vinput_cache *cache = container_of(ref, struct vinput_cache, ref);
+
+	kmem_cache_destroy(cache->cache);
+	kfree(cache);
+}
+
+static void vinput_cache_free(struct vinput *vinput)
+{
+	struct vinput_cache *cache = vinput->cache;
+
+	kmem_cache_free(cache->cache, vinput);
+	kref_put(&cache->ref, vinput_cache_release);
+}
+
+static void vinput_unregister_vdevice(struct vinput *vinput)
+{
+	vinput_state_disable(vinput);
+	vinput_queue_stop(vinput);
+	vinput_input_release(vinput);
+	if (vinput->type->ops->kill)
+		vinput->type->ops->kill(vinput);
+}
+
+static void vinput_destroy_vdevice(struct vinput *vinput)
+{
+	/* Remove from the list first */
+	spin_lock(&vinput_lock);
+	list_del(&vinput->list);
+	clear_bit(vinput->id, vinput_ids);
+	spin_unlock(&vinput_lock);
+
+	if (vinput->done_ctx)
+		eventfd_ctx_put(vinput->done_ctx);
+	kfifo_free(&vinput->queue.fifo);
+
+	/* userspace mappings hold their own reference on the pages */
+	free_page((unsigned long)vinput->desired);
+	free_page((unsigned long)vinput->observed);
+	vinput_cache_free(vinput);
+}
+
+/*
+ * Called when the last reference goes: the input device, evdev clients,
+ * open fds and vinput_get holders all keep the device, possibly after its
+ * type is unregistered. Nothing of the type is used from here on.
+ */
+static void vinput_release_dev(struct device *dev)
+{
+	struct vinput *vinput = dev_to_vinput(dev);
+	int id = vinput->id;
+
+	vinput_destroy_vdevice(vinput);
+
+	pr_debug("released vinput%d.\n", id);
+
+	module_put(THIS_MODULE);
+}
+
+/* a device held back by bulk mode leaves it, called with vinput_lock held */
+static void vinput_bulk_forget(struct vinput *vinput)
+{
+	if (vinput->uevent_deferred) {
+		vinput->uevent_deferred = 0;
+		atomic_dec(&vinput_bulk_deferred);
+	}
+}
+
+/*
+ * Deferred teardown. Unexported devices leave the lookup list at once,
+ * keeping their id, and wait on vinput_dead for the teardown work which
+ * unregisters all of them in one pass. Flush the work to wait for it.
+ */
+static LIST_HEAD(vinput_dead);
+static void vinput_teardown(struct work_struct *work);
+static DECLARE_WORK(vinput_teardown_work, vinput_teardown);
+
+/*
+ * Called with vinput_lock held, and vinput_txn_lock so that transactions
+ * see the devices they target until they are committed.
+ */
+static void vinput_detach(struct vinput *vinput)
+{
+	vinput_bulk_forget(vinput);
+	list_move_tail(&vinput->list, &vinput_dead);
+}
+
+/* detach the devices with an id in [first, last], of a type if not NULL */
+static int vinput_detach_range(long first, long last,
+			       struct vinput_device *type)
+{
+	int count = 0;
+	struct vinput *vinput, *next;
+
+	spin_lock(&vinput_txn_lock);
+	spin_lock(&vinput_lock);
+	list_for_each_entry_safe(vinput, next, &vinput_vdevices, list) {
+		if (vinput->id < first || vinput->id > last)
+			continue;
+		if (type && vinput->type != type)
+			continue;
+		vinput_detach(vinput);
+		count++;
+	}
+	spin_unlock(&vinput_lock);
+	spin_unlock(&vinput_txn_lock);
+
+	return count;
+}
+
+static void vinput_teardown(struct work_struct *work)
+{
+	LIST_HEAD(batch);
+	struct vinput *vinput, *next;
+
+	spin_lock(&vinput_lock);
+	list_splice_init(&vinput_dead, &batch);
+	spin_unlock(&vinput_lock);
+
+	list_for_each_entry_safe(vinput, next, &batch, list) {
+		list_del_init(&vinput->list);
+		vinput_unregister_vdevice(vinput);
+		device_unregister(&vinput->dev);
+	}
+}
+
+/*
+ * Users keeping an exported device without a reference name it by its
+ * pointer and export generation: the device is only dereferenced once
+ * found on the list, and the generation tells a reused one apart.
+ */
+long vinput_exported_id(struct vinput *vinput, u64 gen)
+{
+	long id = -ENODEV;
+	struct vinput *cur;
+
+	spin_lock(&vinput_lock);
+	list_for_each_entry(cur, &vinput_vdevices, list) {
+		if (cur == vinput && cur->gen == gen) {
+			id = cur->id;
+			break;
+		}
+	}
+	spin_unlock(&vinput_lock);
+
+	return id;
+}
+
+/* unexport a device unless it is already gone */
+int vinput_unexport(struct vinput *vinput, u64 gen)
+{
+	int found = 0;
+	struct vinput *cur;
+
+	spin_lock(&vinput_txn_lock);
+	spin_lock(&vinput_lock);
+	list_for_each_entry(cur, &vinput_vdevices, list) {
+		if (cur == vinput && cur->gen == gen) {
+			vinput_detach(cur);
+			found = 1;
+			break;
+		}
+	}
+	spin_unlock(&vinput_lock);
+	spin_unlock(&vinput_txn_lock);
+
+	if (!found)
+		return -ENODEV;
+
+	schedule_work(&vinput_teardown_work);
+
+	return 0;
+}
+
+static ssize_t throttle_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", dev_to_vinput(dev)->flow.throttle);
+}
+
+static ssize_t throttle_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t size)
+{
+	int err;
+	bool val;
+
+	err = kstrtobool(buf, &val);
+	if (err)
+		return err;
+	dev_to_vinput(dev)->flow.throttle = val;
+
+	return size;
+}
+
+/* expected events per frame, evdev sizes the buffers of new clients on it */
+/* the input device is released before the attributes are removed */
+static ssize_t batch_size_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	ssize_t len = -ENODEV;
+	struct vinput *vinput = dev_to_vinput(dev);
+
+	mutex_lock(&vinput->input_lock);
+	if (vinput->input_state != VINPUT_INPUT_GONE)
+		len = sprintf(buf, "%u\n",
+			      vinput->input->hint_events_per_packet);
+	mutex_unlock(&vinput->input_lock);
+
+	return len;
+}
+
+static ssize_t batch_size_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t size)
+{
+	int err;
+	unsigned int val;
+	struct vinput *vinput = dev_to_vinput(dev);
+
+	err = kstrtouint(buf, 10, &val);
+	if (err)
+		return err;
+
+	mutex_lock(&vinput->input_lock);
+	if (vinput->input_state == VINPUT_INPUT_GONE)
+		err = -ENODEV;
+	else
+		vinput->input->hint_events_per_packet = val;
+	mutex_unlock(&vinput->input_lock);
+
+	return err ? err : size;
+}
+
+static ssize_t latency_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	ssize_t len;
+	unsigned long flags;
+	struct vinput_latency *lat = &dev_to_vinput(dev)->latency;
+
+	spin_lock_irqsave(&lat->lock, flags);
+	len = sprintf(buf, "count %lu\np50 %llu\np99 %llu\nmax %llu\n",
+		      lat->count, vinput_lat_percentile(lat, 50),
+		      vinput_lat_percentile(lat, 99), lat->max);
+	spin_unlock_irqrestore(&lat->lock, flags);
+
+	return len;
+}
+
+/* any write resets the histogram */
+static ssize_t latency_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t size)
+{
+	unsigned long flags;
+	struct vinput_latency *lat = &dev_to_vinput(dev)->latency;
+
+	spin_lock_irqsave(&lat->lock, flags);
+	lat->max = 0;
+	lat->count = 0;
+	memset(lat->buckets, 0, sizeof(lat->buckets));
+	spin_unlock_irqrestore(&lat->lock, flags);
+
+	return size;
+}
+
+static ssize_t vinput_rate_show(struct device *dev, char *buf,
+				struct vinput_bucket *b)
+{
+	return sprintf(buf, "%u\n", b->rate);
+}
+
+static ssize_t vinput_rate_store(struct device *dev, const char *buf,
+				 size_t size, struct vinput_bucket *b)
+{
+	int err;
+	unsigned int val;
+	unsigned long flags;
+	struct vinput *vinput = dev_to_vinput(dev);
+
+	err = kstrtouint(buf, 10, &val);
+	if (err)
+		return err;
+
+	spin_lock_irqsave(&vinput->state_lock, flags);
+	vinput_bucket_set(b, val);
+	vinput_rate_reset(&vinput->rate);
+	spin_unlock_irqrestore(&vinput->state_lock, flags);
+
+	return size;
+}
+
+/* events per second, 0 for unlimited */
+static ssize_t rate_events_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return vinput_rate_show(dev, buf, &dev_to_vinput(dev)->rate.events);
+}
+
+static ssize_t rate_events_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t size)
+{
+	return vinput_rate_store(dev, buf, size,
+				 &dev_to_vinput(dev)->rate.events);
+}
+
+/* frames per second, 0 for unlimited */
+static ssize_t rate_frames_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return vinput_rate_show(dev, buf, &dev_to_vinput(dev)->rate.frames);
+}
+
+static ssize_t rate_frames_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t size)
+{
+	return vinput_rate_store(dev, buf, size,
+				 &dev_to_vinput(dev)->rate.frames);
+}
+
+static const char * const vinput_rate_modes[] = {
+	[VINPUT_RATE_BLOCK] = "block",
+	[VINPUT_RATE_DROP] = "drop",
+	[VINPUT_RATE_QUEUE] = "queue",
+};
+
+static ssize_t rate_mode_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n",
+		       vinput_rate_modes[dev_to_vinput(dev)->rate.mode]);
+}
+
+static ssize_t rate_mode_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t size)
+{
+	int i;
+	unsigned long flags;
+	struct vinput *vinput = dev_to_vinput(dev);
+
+	for (i = 0; i < ARRAY_SIZE(vinput_rate_modes); i++) {
+		if (sysfs_streq(buf, vinput_rate_modes[i])) {
+			spin_lock_irqsave(&vinput->state_lock, flags);
+			vinput->rate.mode = i;
+			vinput_rate_reset(&vinput->rate);
+			spin_unlock_irqrestore(&vinput->state_lock, flags);
+			return size;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static ssize_t group_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", dev_to_vinput(dev)->rate.group);
+}
+
+static ssize_t group_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t size)
+{
+	int err;
+	unsigned int val;
+	unsigned long flags;
+	struct vinput *vinput = dev_to_vinput(dev);
+
+	err = kstrtouint(buf, 10, &val);
+	if (err)
+		return err;
+	if (val > VINPUT_RATE_GROUPS)
+		return -EINVAL;
 
-	module_put(THIS_MODULE);
+	spin_lock_irqsave(&vinput->state_lock, flags);
+	vinput->rate.group = val;
+	vinput_rate_reset(&vinput->rate);
+	spin_unlock_irqrestore(&vinput->state_lock, flags);
 
-	kfree(vinput);
+	return size;
 }
 
-static void vinput_release_dev(struct device *dev)
+static ssize_t late_show(struct device *dev,
+			 struct device_attribute *attr, char *buf)
 {
-	struct vinput *vinput = dev_to_vinput(dev);
-	int id = vinput->id;
-
-	vinput_destroy_vdevice(vinput);
+	return sprintf(buf, "%lu\n", dev_to_vinput(dev)->queue_late);
+}
 
-	pr_debug("released vinput%d.\n", id);
+static ssize_t rate_dropped_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", dev_to_vinput(dev)->rate.dropped);
 }
 
-static struct vinput *vinput_alloc_vdevice(void)
+static DEVICE_ATTR(throttle, S_IWUSR | S_IRUGO, throttle_show, throttle_store);
+static DEVICE_ATTR(batch_size, S_IWUSR | S_IRUGO, batch_size_show,
+		   batch_size_store);
+static DEVICE_ATTR(latency, S_IWUSR | S_IRUGO, latency_show, latency_store);
+static DEVICE_ATTR(rate_events, S_IWUSR | S_IRUGO, rate_events_show,
+		   rate_events_store);
+static DEVICE_ATTR(rate_frames, S_IWUSR | S_IRUGO, rate_frames_show,
+		   rate_frames_store);
+static DEVICE_ATTR(rate_mode, S_IWUSR | S_IRUGO, rate_mode_show,
+		   rate_mode_store);
+static DEVICE_ATTR(group, S_IWUSR | S_IRUGO, group_show, group_store);
+static DEVICE_ATTR(rate_dropped, S_IRUGO, rate_dropped_show, NULL);
+static DEVICE_ATTR(late, S_IRUGO, late_show, NULL);
+
+#define VINPUT_FLOW_ATTR(_name)						\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	return sprintf(buf, "%lu\n", dev_to_vinput(dev)->flow._name);	\
+}									\
+static DEVICE_ATTR(_name, S_IRUGO, _name##_show, NULL)
+
+VINPUT_FLOW_ATTR(events);
+VINPUT_FLOW_ATTR(frames);
+VINPUT_FLOW_ATTR(est_drops);
+VINPUT_FLOW_ATTR(throttled);
+
+static struct attribute *vinput_dev_attrs[] = {
+	&dev_attr_throttle.attr,
+	&dev_attr_batch_size.attr,
+	&dev_attr_latency.attr,
+	&dev_attr_rate_events.attr,
+	&dev_attr_rate_frames.attr,
+	&dev_attr_rate_mode.attr,
+	&dev_attr_group.attr,
+	NULL,
+};
+
+static struct attribute *vinput_stats_attrs[] = {
+	&dev_attr_events.attr,
+	&dev_attr_frames.attr,
+	&dev_attr_est_drops.attr,
+	&dev_attr_throttled.attr,
+	&dev_attr_rate_dropped.attr,
+	&dev_attr_late.attr,
+	NULL,
+};
+
+static const struct attribute_group vinput_dev_group = {
+	.attrs = vinput_dev_attrs,
+};
+
+static const struct attribute_group vinput_stats_group = {
+	.name = "stats",
+	.attrs = vinput_stats_attrs,
+};
+
+static const struct attribute_group *vinput_dev_groups[] = {
+	&vinput_dev_group,
+	&vinput_stats_group,
+	NULL,
+};
+
+/*
+ * Allocate everything a device needs, short of an id. Exported devices
+ * usually come out of the pool of their type, filled in the background.
+ * The private data of the type follows struct vinput in its cache.
+ */
+static struct vinput *vinput_alloc_vdevice(struct vinput_device *type)
 {
 	int err;
-	struct vinput *vinput = kzalloc(sizeof(struct vinput), GFP_KERNEL);
+	struct vinput *vinput = kmem_cache_zalloc(type->cache->cache,
+						  GFP_KERNEL);
 
-	try_module_get(THIS_MODULE);
+	if (!vinput)
+		return ERR_PTR(-ENOMEM);
 
-	memset(vinput, 0, sizeof(struct vinput));
+	vinput->cache = type->cache;
+	kref_get(&vinput->cache->ref);
+	vinput->type = type;
+	if (type->priv_size)
+		vinput->priv_data = vinput + 1;
 
 	spin_lock_init(&vinput->lock);
+	spin_lock_init(&vinput->state_lock);
+	spin_lock_init(&vinput->latency.lock);
+	mutex_init(&vinput->input_lock);
 
-	spin_lock(&vinput_lock);
-	vinput->id = find_first_zero_bit(vinput_ids, VINPUT_MINORS);
-	if (vinput->id >= VINPUT_MINORS) {
-		err = -ENOBUFS;
-		goto fail_id;
+	vinput->observed = (struct vinput_state *)get_zeroed_page(GFP_KERNEL);
+	if (!vinput->observed) {
+		err = -ENOMEM;
+		goto fail_page;
 	}
-	set_bit(vinput->id, vinput_ids);
-	list_add(&vinput->list, &vinput_vdevices);
-	spin_unlock(&vinput_lock);
+
+	err = vinput_queue_init(vinput);
+	if (err)
+		goto fail_queue;
 
 	/* allocate the input device */
 	vinput->input = input_allocate_device();
@@ -193,21 +3463,119 @@ static struct vinput *vinput_alloc_vdevice(void)
 
 	/* initialize device */
 	vinput->dev.class = &vinput_class;
+	vinput->dev.groups = vinput_dev_groups;
 	vinput->dev.release = vinput_release_dev;
-	vinput->dev.devt = MKDEV(vinput_dev, vinput->id);
-	dev_set_name(&vinput->dev, DRIVER_NAME "%lu", vinput->id);
 
 	return vinput;
 
 fail_input_dev:
+	kfifo_free(&vinput->queue.fifo);
+fail_queue:
+	free_page((unsigned long)vinput->observed);
+fail_page:
+	vinput_cache_free(vinput);
+
+	return ERR_PTR(err);
+}
+
+/* free a device that never got an id */
+static void vinput_free_vdevice(struct vinput *vinput)
+{
+	input_free_device(vinput->input);
+	kfifo_free(&vinput->queue.fifo);
+	free_page((unsigned long)vinput->observed);
+	vinput_cache_free(vinput);
+}
+
+/* give the device an id and make it visible to the lookups */
+static int vinput_add_vdevice(struct vinput *vinput)
+{
 	spin_lock(&vinput_lock);
-	list_del(&vinput->list);
-fail_id:
+	vinput->id = find_first_zero_bit(vinput_ids, VINPUT_MINORS);
+	if (vinput->id >= VINPUT_MINORS) {
+		spin_unlock(&vinput_lock);
+		return -ENOBUFS;
+	}
+	set_bit(vinput->id, vinput_ids);
+	list_add(&vinput->list, &vinput_vdevices);
 	spin_unlock(&vinput_lock);
-	module_put(THIS_MODULE);
-	kfree(vinput);
 
-	return ERR_PTR(err);
+	try_module_get(THIS_MODULE);
+
+	vinput->dev.devt = MKDEV(vinput_dev, vinput->id);
+	dev_set_name(&vinput->dev, DRIVER_NAME "%lu", vinput->id);
+
+	return 0;
+}
+
+/*
+ * Warm pool. Each type keeps up to pool_size allocated devices on its
+ * pool list, under vinput_lock, refilled from a work item. Types are
+ * added and removed under vinput_pool_mutex so that the refill can walk
+ * them while allocating.
+ */
+static void vinput_pool_refill(struct work_struct *work);
+static DECLARE_WORK(vinput_pool_work, vinput_pool_refill);
+static DEFINE_MUTEX(vinput_pool_mutex);
+
+static struct vinput *vinput_pool_take(struct vinput_device *type)
+{
+	struct vinput *vinput = NULL;
+
+	spin_lock(&vinput_lock);
+	if (!list_empty(&type->pool)) {
+		vinput = list_first_entry(&type->pool, struct vinput, list);
+		list_del(&vinput->list);
+		type->pool_count--;
+	}
+	spin_unlock(&vinput_lock);
+
+	return vinput;
+}
+
+static void vinput_pool_drain(struct vinput_device *type, unsigned int size)
+{
+	struct vinput *vinput;
+
+	while (READ_ONCE(type->pool_count) > size) {
+		vinput = vinput_pool_take(type);
+		if (!vinput)
+			break;
+		vinput_free_vdevice(vinput);
+	}
+}
+
+static void vinput_pool_refill(struct work_struct *work)
+{
+	struct vinput *vinput;
+	struct vinput_device *type;
+
+	mutex_lock(&vinput_pool_mutex);
+	list_for_each_entry(type, &vinput_devices, list) {
+		vinput_pool_drain(type, pool_size);
+		while (READ_ONCE(type->pool_count) < pool_size) {
+			vinput = vinput_alloc_vdevice(type);
+			if (IS_ERR(vinput))
+				goto out;
+
+			spin_lock(&vinput_lock);
+			list_add(&vinput->list, &type->pool);
+			type->pool_count++;
+			spin_unlock(&vinput_lock);
+		}
+	}
+out:
+	mutex_unlock(&vinput_pool_mutex);
+}
+
+static struct vinput *vinput_pool_get(struct vinput_device *type)
+{
+	struct vinput *vinput = vinput_pool_take(type);
+
+	if (pool_size)
+		schedule_work(&vinput_pool_work);
+
+	return vinput ? vinput : vinput_alloc_vdevice(type);
 }
 
 static int vinput_register_vdevice(struct vinput *vinput)
@@ -233,27 +3601,68 @@ static int vinput_register_vdevice(struct vinput *vinput)
 	return err;
 }
 
-static ssize_t export_store(struct class *class, struct class_attribute *attr,
-			    const char *buf, size_t len)
+/*
+ * Apply a "key=val,key=val" configuration through the config op of the
+ * device type, in order. The string is modified.
+ */
+static int vinput_config(struct vinput *vinput, char *config)
 {
 	int err;
-	struct vinput *vinput;
-	struct vinput_device *device;
+	char *key, *val;
 
-	device = vinput_get_device_by_type(buf);
-	if (IS_ERR(device)) {
-		pr_info("vinput: This virtual device isn't registered\n");
-		err = PTR_ERR(device);
-		goto fail;
+	while ((key = strsep(&config, ","))) {
+		key = strim(key);
+		if (!*key)
+			continue;
+
+		val = strchr(key, '=');
+		if (!val || !vinput->type->ops->config)
+			return -EINVAL;
+		*val++ = '\0';
+
+		err = vinput->type->ops->config(vinput, strim(key), strim(val));
+		if (err < 0) {
+			dev_err(&vinput->dev, "invalid setting %s=%s\n", key, val);
+			return err;
+		}
 	}
 
-	vinput = vinput_alloc_vdevice();
+	return 0;
+}
+
+/* create a vinputX device of the given type, config may be NULL */
+struct vinput *vinput_export(struct vinput_device *device,
+				    const char *config)
+{
+	int err;
+	int bulk;
+	char *conf;
+	struct vinput *vinput;
+	u64 start = ktime_get_ns();
+
+	vinput = vinput_pool_get(device);
 	if (IS_ERR(vinput)) {
 		err = PTR_ERR(vinput);
 		goto fail;
 	}
+	vinput->gen = atomic64_inc_return(&vinput_export_gen);
+
+	err = vinput_add_vdevice(vinput);
+	if (err < 0) {
+		vinput_free_vdevice(vinput);
+		goto fail;
+	}
+
+	down_read(&vinput_bulk_sem);
+	bulk = vinput_bulk;
+	if (bulk) {
+		dev_set_uevent_suppress(&vinput->dev, 1);
+		spin_lock(&vinput_lock);
+		vinput->uevent_deferred = 1;
+		atomic_inc(&vinput_bulk_deferred);
+		spin_unlock(&vinput_lock);
+	}
 
-	vinput->type = device;
 	err = device_register(&vinput->dev);
 	if (err < 0)
 		goto fail_register;
@@ -262,47 +3671,336 @@ static ssize_t export_store(struct class *class, struct class_attribute *attr,
 	if (err < 0)
 		goto fail_register_vinput;
 
-	return len;
+	if (config) {
+		conf = kstrdup(config, GFP_KERNEL);
+		err = conf ? vinput_config(vinput, conf) : -ENOMEM;
+		kfree(conf);
+		if (err < 0)
+			goto fail_config;
+	}
+
+	up_read(&vinput_bulk_sem);
 
+	atomic64_add(ktime_get_ns() - start, &vinput_export_ns[bulk]);
+	atomic_inc(&vinput_export_count[bulk]);
+
+	return vinput;
+
+fail_config:
+	vinput_unregister_vdevice(vinput);
 fail_register_vinput:
+	spin_lock(&vinput_lock);
+	vinput_bulk_forget(vinput);
+	spin_unlock(&vinput_lock);
 	device_unregister(&vinput->dev);
+	up_read(&vinput_bulk_sem);
+	return ERR_PTR(err);
 fail_register:
+	spin_lock(&vinput_lock);
+	vinput_bulk_forget(vinput);
+	spin_unlock(&vinput_lock);
+	up_read(&vinput_bulk_sem);
 	vinput_destroy_vdevice(vinput);
+	module_put(THIS_MODULE);
 fail:
-	return err;
+	return ERR_PTR(err);
+}
+
+/* takes a type name, optionally followed by its configuration */
+static ssize_t export_store(struct class *class, struct class_attribute *attr,
+			    const char *buf, size_t len)
+{
+	size_t n;
+	char name[16];
+	const char *config;
+	struct vinput *vinput;
+	struct vinput_device *device;
+
+	n = strcspn(buf, " \t\n");
+	if (n >= sizeof(name))
+		return -ENODEV;
+	memcpy(name, buf, n);
+	name[n] = '\0';
+
+	device = vinput_get_device_by_type(name);
+	if (IS_ERR(device)) {
+		pr_info("vinput: This virtual device isn't registered\n");
+		return PTR_ERR(device);
+	}
+
+	config = buf + n;
+	if (!isspace(*config))
+		config = NULL;
+
+	vinput = vinput_export(device, config);
+	if (IS_ERR(vinput))
+		return PTR_ERR(vinput);
+
+	return len;
+}
+
+/*
+ * Create the devices listed for a type in the devices module parameter,
+ * e.g. "vkbd:4;vts_mt:2:type=B,max_x=1023,max_y=767,max_z=255,max_points=10"
+ */
+static void vinput_create_devices(struct vinput_device *device)
+{
+	char *list, *next, *entry, *name, *count;
+	unsigned int n;
+	struct vinput *vinput;
+
+	if (!devices || !*devices)
+		return;
+
+	list = kstrdup(devices, GFP_KERNEL);
+	if (!list)
+		return;
+
+	next = list;
+	while ((entry = strsep(&next, ";"))) {
+		name = strsep(&entry, ":");
+		if (strcmp(strim(name), device->name))
+			continue;
+
+		count = strsep(&entry, ":");
+		if (!count || kstrtouint(strim(count), 10, &n)) {
+			pr_err("vinput: invalid devices entry for '%s'\n",
+			       device->name);
+			continue;
+		}
+
+		while (n--) {
+			vinput = vinput_export(device, entry);
+			if (IS_ERR(vinput)) {
+				pr_err("vinput: cannot create '%s' device: %ld\n",
+				       device->name, PTR_ERR(vinput));
+				break;
+			}
+		}
+	}
+
+	kfree(list);
+}
+
+/*
+ * Bulk creation. While bulk is set, exported devices are created without
+ * uevents and without registering their input device. Releasing the bulk
+ * announces all of them at once, and registers their input devices unless
+ * lazy_register keeps them for their first use.
+ */
+static void vinput_bulk_release(void)
+{
+	int count = 0;
+	unsigned long id;
+	struct vinput *vinput;
+	u64 start = ktime_get_ns();
+	DECLARE_BITMAP(ids, VINPUT_MINORS);
+
+	/* devices unexported from now on are no longer counted */
+	bitmap_zero(ids, VINPUT_MINORS);
+	spin_lock(&vinput_lock);
+	list_for_each_entry(vinput, &vinput_vdevices, list) {
+		if (vinput->uevent_deferred) {
+			vinput->uevent_deferred = 0;
+			set_bit(vinput->id, ids);
+		}
+	}
+	atomic_set(&vinput_bulk_deferred, 0);
+	spin_unlock(&vinput_lock);
+
+	/* held while registering, which sleeps and races with unexport */
+	for_each_set_bit(id, ids, VINPUT_MINORS) {
+		vinput = vinput_get(id);
+		if (IS_ERR(vinput))
+			continue;
+
+		dev_set_uevent_suppress(&vinput->dev, 0);
+		kobject_uevent(&vinput->dev.kobj, KOBJ_ADD);
+		if (!lazy_register)
+			vinput_input_ensure(vinput);
+		vinput_put(vinput);
+		count++;
+	}
+
+	vinput_bulk_release_ns = ktime_get_ns() - start;
+	pr_info("vinput: released %d devices in %llu us\n",
+		count, vinput_bulk_release_ns / NSEC_PER_USEC);
+}
+
+static u64 vinput_export_mean_us(int bulk)
+{
+	int count = atomic_read(&vinput_export_count[bulk]);
+
+	if (!count)
+		return 0;
+
+	return div64_u64(atomic64_read(&vinput_export_ns[bulk]),
+			 (u64)count * NSEC_PER_USEC);
+}
+
+/*
+ * "<bulk mode> <devices held back> <last release time in us>
+ *  <mean export time in us> <mean export time in bulk mode in us>"
+ */
+static ssize_t bulk_show(struct class *class, struct class_attribute *attr,
+			 char *buf)
+{
+	ssize_t len;
+
+	down_read(&vinput_bulk_sem);
+	len = sprintf(buf, "%d %d %llu %llu %llu\n", vinput_bulk,
+		      atomic_read(&vinput_bulk_deferred),
+		      vinput_bulk_release_ns / NSEC_PER_USEC,
+		      vinput_export_mean_us(0), vinput_export_mean_us(1));
+	up_read(&vinput_bulk_sem);
+
+	return len;
+}
+
+static ssize_t bulk_store(struct class *class, struct class_attribute *attr,
+			  const char *buf, size_t len)
+{
+	int err;
+	bool val;
+
+	err = kstrtobool(buf, &val);
+	if (err)
+		return err;
+
+	down_write(&vinput_bulk_sem);
+	if (val && !vinput_bulk) {
+		vinput_bulk = 1;
+		atomic_set(&vinput_bulk_deferred, 0);
+	} else if (!val && vinput_bulk) {
+		vinput_bulk = 0;
+		vinput_bulk_release();
+	}
+	up_write(&vinput_bulk_sem);
+
+	return len;
 }
 
+/* takes an id, a range of ids ("10-73"), a device type name or "all" */
 static ssize_t unexport_store(struct class *class, struct class_attribute *attr,
 			      const char *buf, size_t len)
 {
 	int err;
-	unsigned long id;
-	struct vinput *vinput;
+	int count;
+	long first = 0, last = VINPUT_MINORS - 1;
+	struct vinput_device *type = NULL;
 
-	err = kstrtol(buf, 10, &id);
-	if (err) {
-		err = -EINVAL;
-		goto failed;
+	if (sysfs_streq(buf, "all")) {
+		/* every device */
+	} else if (sscanf(buf, "%ld-%ld", &first, &last) == 2) {
+		if (first < 0 || first > last) {
+			err = -EINVAL;
+			goto failed;
+		}
+	} else if (!kstrtol(buf, 10, &first)) {
+		last = first;
+	} else {
+		type = vinput_get_device_by_type(buf);
+		if (IS_ERR(type)) {
+			err = -EINVAL;
+			goto failed;
+		}
 	}
 
-	vinput = vinput_get_vdevice_by_id(id);
-	if (IS_ERR(vinput)) {
-		pr_err("vinput: No such vinput device %ld\n", id);
-		err = PTR_ERR(vinput);
+	count = vinput_detach_range(first, last, type);
+	if (!count && first == last) {
+		pr_err("vinput: No such vinput device %ld\n", first);
+		err = -ENODEV;
 		goto failed;
 	}
 
-	vinput_unregister_vdevice(vinput);
-	device_unregister(&vinput->dev);
+	schedule_work(&vinput_teardown_work);
 
 	return len;
 failed:
 	return err;
 }
 
+static ssize_t group_rate_show(struct class *class,
+			       struct class_attribute *attr, char *buf)
+{
+	int i;
+	ssize_t len = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vinput_group_lock, flags);
+	for (i = 0; i < VINPUT_RATE_GROUPS; i++)
+		len += sprintf(buf + len, "%d %u %u\n", i + 1,
+			       vinput_rate_groups[i].events.rate,
+			       vinput_rate_groups[i].frames.rate);
+	spin_unlock_irqrestore(&vinput_group_lock, flags);
+
+	return len;
+}
+
+/* "<group> <events/s> <frames/s>", 0 for unlimited */
+static ssize_t group_rate_store(struct class *class,
+				struct class_attribute *attr,
+				const char *buf, size_t len)
+{
+	unsigned long flags;
+	unsigned int group, events, frames;
+	struct vinput_rate_group *g;
+
+	if (sscanf(buf, "%u %u %u", &group, &events, &frames) != 3)
+		return -EINVAL;
+	if (!group || group > VINPUT_RATE_GROUPS)
+		return -EINVAL;
+
+	g = &vinput_rate_groups[group - 1];
+	spin_lock_irqsave(&vinput_group_lock, flags);
+	vinput_bucket_set(&g->events, events);
+	vinput_bucket_set(&g->frames, frames);
+	spin_unlock_irqrestore(&vinput_group_lock, flags);
+
+	return len;
+}
+
+static ssize_t pool_size_show(struct class *class,
+			      struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", pool_size);
+}
+
+static ssize_t pool_size_store(struct class *class,
+			       struct class_attribute *attr,
+			       const char *buf, size_t len)
+{
+	int err;
+	unsigned int val;
+
+	err = kstrtouint(buf, 10, &val);
+	if (err)
+		return err;
+	if (val > VINPUT_MINORS)
+		return -EINVAL;
+
+	pool_size = val;
+	schedule_work(&vinput_pool_work);
+
+	return len;
+}
+
+/* wait for the devices unexported so far to be gone */
+static ssize_t sync_store(struct class *class, struct class_attribute *attr,
+			  const char *buf, size_t len)
+{
+	flush_work(&vinput_teardown_work);
+
+	return len;
+}
+
 static struct class_attribute vinput_class_attrs[] = {
 	__ATTR(export, 0200, NULL, export_store),
 	__ATTR(unexport, 0200, NULL, unexport_store),
+	__ATTR(group_rate, 0644, group_rate_show, group_rate_store),
+	__ATTR(pool_size, 0644, pool_size_show, pool_size_store),
+	__ATTR(sync, 0200, NULL, sync_store),
+	__ATTR(bulk, 0644, bulk_show, bulk_store),
 	__ATTR_NULL,
 };
 
@@ -314,34 +4012,49 @@ static struct class vinput_class = {
 
 int vinput_register(struct vinput_device *dev)
 {
+	dev->cache = vinput_cache_create(dev);
+	if (!dev->cache)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&dev->pool);
+	dev->pool_count = 0;
+
+	mutex_lock(&vinput_pool_mutex);
 	spin_lock(&vinput_lock);
 	list_add(&dev->list, &vinput_devices);
 	spin_unlock(&vinput_lock);
+	mutex_unlock(&vinput_pool_mutex);
+
+	if (pool_size)
+		schedule_work(&vinput_pool_work);
 
 	pr_info("vinput: registered new virtual input device '%s'\n",
 		dev->name);
 
+	vinput_create_devices(dev);
+
 	return 0;
 }
 EXPORT_SYMBOL(vinput_register);
 
 void vinput_unregister(struct vinput_device *dev)
 {
-	struct list_head *curr, *next;
-
 	/* Remove from the list first */
+	mutex_lock(&vinput_pool_mutex);
 	spin_lock(&vinput_lock);
 	list_del(&dev->list);
 	spin_unlock(&vinput_lock);
+	vinput_pool_drain(dev, 0);
+	mutex_unlock(&vinput_pool_mutex);
 
 	/* unregister all devices of thhis type */
-	list_for_each_safe(curr, next, &vinput_vdevices) {
-		struct vinput *vinput = list_entry(curr, struct vinput, list);
-		if (vinput && vinput->type == dev) {
-			vinput_unregister_vdevice(vinput);
-			device_unregister(&vinput->dev);
-		}
-	}
+	vinput_detach_range(0, VINPUT_MINORS - 1, dev);
+
+	schedule_work(&vinput_teardown_work);
+	flush_work(&vinput_teardown_work);
+
+	/* devices still referenced keep the cache */
+	kref_put(&dev->cache->ref, vinput_cache_release);
 
 	pr_info("vinput: unregistered virtual input device '%s'\n",
 		dev->name);
@@ -354,6 +4067,13 @@ static int __init vinput_init(void)
 
 	pr_info("vinput: Loading virtual input driver\n");
 
+	/* the queues must have room for a record besides their reserve */
+	if (queue_depth < 2 * VINPUT_QUEUE_RESERVE) {
+		pr_err("vinput: queue_depth must be at least %d\n",
+		       2 * VINPUT_QUEUE_RESERVE);
+		return -EINVAL;
+	}
+
 	vinput_dev = register_chrdev(0, DRIVER_NAME, &vinput_fops);
 	if (vinput_dev < 0) {
 		pr_err("vinput: Unable to allocate char dev region\n");
@@ -362,15 +4082,45 @@ static int __init vinput_init(void)
 
 	spin_lock_init(&vinput_lock);
 
+	hrtimer_init(&vinput_sched_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	vinput_sched_timer.function = vinput_sched_timer_fn;
+
 	err = class_register(&vinput_class);
 	if (err < 0) {
 		pr_err("vinput: Unable to register vinput class\n");
 		goto failed_class;
 	}
 
+	err = input_register_handler(&vinput_lat_handler);
+	if (err < 0) {
+		pr_err("vinput: Unable to register latency handler\n");
+		goto failed_handler;
+	}
+
+	vinput_ctl = device_create(&vinput_class, NULL,
+				   MKDEV(vinput_dev, VINPUT_CTL_MINOR), NULL,
+				   DRIVER_NAME "ctl");
+	if (IS_ERR(vinput_ctl)) {
+		pr_err("vinput: Unable to create control node\n");
+		err = PTR_ERR(vinput_ctl);
+		goto failed_ctl;
+	}
+
+	err = vinput_configfs_init();
+	if (err < 0) {
+		pr_err("vinput: Unable to register configfs subsystem\n");
+		goto failed_configfs;
+	}
+
 	return 0;
-failed_class:
+failed_configfs:
+	device_destroy(&vinput_class, MKDEV(vinput_dev, VINPUT_CTL_MINOR));
+failed_ctl:
+	input_unregister_handler(&vinput_lat_handler);
+failed_handler:
 	class_unregister(&vinput_class);
+failed_class:
+	unregister_chrdev(vinput_dev, DRIVER_NAME);
 failed_alloc:
 	return err;
 }
@@ -379,6 +4129,15 @@ static void __exit vinput_end(void)
 {
 	pr_info("vinput: Unloading virtual input driver\n");
 
+	vinput_configfs_exit();
+
+	cancel_delayed_work_sync(&vinput_state_work);
+	cancel_work_sync(&vinput_pool_work);
+	flush_work(&vinput_teardown_work);
+	hrtimer_cancel(&vinput_sched_timer);
+
+	device_destroy(&vinput_class, MKDEV(vinput_dev, VINPUT_CTL_MINOR));
+	input_unregister_handler(&vinput_lat_handler);
 	unregister_chrdev(vinput_dev, DRIVER_NAME);
 	class_unregister(&vinput_class);
 }
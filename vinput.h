@@ -4,20 +4,100 @@
 #include <linux/init.h>
 #include <linux/input.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/cdev.h>
+#include <linux/kfifo.h>
+#include <linux/rbtree.h>
+#include <linux/wait.h>
 #include <asm/uaccess.h>
 
+#include "vinput_uapi.h"
+
 #define VINPUT_MAX_LEN		128
 #define MAX_VINPUT		32
 #define VINPUT_MINORS   	MAX_VINPUT
+#define VINPUT_CTL_MINOR	MAX_VINPUT
 
 #define dev_to_vinput(dev)      container_of(dev, struct vinput, dev)
 
 struct vinput_device;
+struct vinput_cache;
+
+/* playback queue entry, a VINPUT_QEV_DONE entry completes batch seq */
+#define VINPUT_QEV_DONE		EV_CNT
+
+struct vinput_qevent {
+	u64 time;
+	u64 seq;
+	u16 type;
+	u16 code;
+	s32 value;
+};
+
+/* a producer of timed events, merged with the others of its device */
+struct vinput_stream {
+	DECLARE_KFIFO_PTR(fifo, struct vinput_qevent);
+	struct list_head list;
+	u64 tail;
+};
+
+/* frames sent downstream, estimated against the evdev client buffers */
+struct vinput_flow {
+	unsigned int frame;
+	unsigned int last_frame;
+	unsigned int backlog;
+	u64 window;
+	int throttle;
+
+	unsigned long events;
+	unsigned long frames;
+	unsigned long est_drops;
+	unsigned long throttled;
+};
+
+/* token bucket, tokens are counted in 1/NSEC_PER_SEC units */
+struct vinput_bucket {
+	unsigned int rate;	/* per second, 0 for unlimited */
+	s64 tokens;
+	u64 last;
+};
+
+#define VINPUT_RATE_BLOCK	0
+#define VINPUT_RATE_DROP	1
+#define VINPUT_RATE_QUEUE	2
+
+struct vinput_rate {
+	struct vinput_bucket events;
+	struct vinput_bucket frames;
+	int mode;
+	int group;		/* 1 to VINPUT_RATE_GROUPS, 0 for none */
+	u64 paced;		/* queue mode: time of the frame being paced */
+	unsigned int pace_events;
+	unsigned long dropped;
+};
+
+#define VINPUT_RATE_GROUPS	8
+
+/* write to delivery latency of the frames, log2 histogram in ns */
+#define VINPUT_LAT_BUCKETS	32
+
+struct vinput_latency {
+	spinlock_t lock;
+	u64 inject;		/* injection time of the frames being sent */
+	u64 max;
+	unsigned long count;
+	unsigned long buckets[VINPUT_LAT_BUCKETS];
+};
+
+#define VINPUT_INPUT_NONE	0
+#define VINPUT_INPUT_PENDING	1	/* registration deferred */
+#define VINPUT_INPUT_REGISTERED	2
+#define VINPUT_INPUT_GONE	3	/* released, vinput->input is freed */
 
 struct vinput {
 	long id;
+	u64 gen;		/* export generation, unique unlike the id */
 	long devno;
 	long last_entry;
 	spinlock_t lock;
@@ -28,20 +108,160 @@ struct vinput {
 	struct list_head list;
 	struct input_dev *input;
 	struct vinput_device *type;
+	struct vinput_cache *cache;	/* of the type, outlives it */
+
+	/* desired state mode */
+	struct vinput_state *desired;
+	struct vinput_state *applied;
+
+	/* state published to observers, see vinput_sync() */
+	spinlock_t state_lock;
+	int state_slot;
+	struct vinput_state shadow;
+	struct vinput_state *observed;
+
+	struct mutex input_lock;
+	int input_state;
+	int uevent_deferred;	/* created in bulk mode */
+	int input_used;		/* used before it could be registered */
+
+	struct vinput_flow flow;
+	struct vinput_latency latency;
+	struct vinput_rate rate;
+
+	/* batch completion */
+	atomic64_t submitted;
+	u64 completed;
+	u64 failed;
+	struct eventfd_ctx *done_ctx;
+
+	/* timed playback, queue_lock also serialises all emission */
+	spinlock_t queue_lock;
+	struct vinput_stream queue;	/* control node stream */
+	struct list_head streams;
+	struct vinput_stream *queue_cur;	/* frame being played */
+	unsigned long queue_late;
+	int queue_stopped;
+	int frame_open;		/* direct frames open, holds the queue */
+	int queue_held;		/* off the timeline, to be resumed */
+	wait_queue_head_t queue_wait;
+	struct rb_node sched_node;	/* in the scheduler timeline */
+	u64 sched_time;
 };
 
 struct vinput_ops {
 	int (*init) (struct vinput *);
 	int (*kill) (struct vinput *);
+	/* a text write, called under queue_lock */
 	int (*send) (struct vinput *, char *, int);
 	int (*read) (struct vinput *, char *, int);
+	/* optional, applies one key=val setting of an export configuration */
+	int (*config) (struct vinput *, const char *, const char *);
+	/*
+	 * Optional binary paths. send_batch takes validated records of one
+	 * device and reports them itself. Otherwise the core reports them,
+	 * calling begin before the first event of each frame and commit
+	 * before syncing it. These may run in atomic context.
+	 */
+	int (*send_batch) (struct vinput *, const struct vinput_record *, int);
+	void (*begin) (struct vinput *);
+	void (*commit) (struct vinput *);
+	/* optional, fills the type specific limits of VINPUT_IOC_GET_INFO */
+	void (*info) (struct vinput *, struct vinput_info *);
 };
 
 struct vinput_device {
 	char name[16];
+	struct module *owner;	/* pinned by vinput_get */
 	struct list_head list;
 	struct vinput_ops *ops;
+	/* size of the zeroed private data found at vinput->priv_data */
+	size_t priv_size;
+
+	/* struct vinput and private data, managed by the core */
+	struct vinput_cache *cache;
+
+	/* pre-allocated devices, managed by the core */
+	struct list_head pool;
+	unsigned int pool_count;
 };
 
 int vinput_register(struct vinput_device *dev);
 void vinput_unregister(struct vinput_device *dev);
+
+/* called by the types init instead of input_register_device */
+int vinput_register_input(struct vinput *vinput);
+
+/*
+ * In-kernel injection. vinput_get returns a referenced device, its type
+ * module pinned, or an ERR_PTR, to be released with vinput_put.
+ * vinput_inject emits a batch of records (rec.id is ignored) and returns
+ * the number consumed. vinput_get_info fills what VINPUT_IOC_GET_INFO
+ * returns, or fails with -ENODEV once the device is unexported.
+ */
+#define VINPUT_INJECT_NONBLOCK	(1 << 0)	/* -EAGAIN rather than wait */
+
+struct vinput *vinput_get(long id);
+void vinput_put(struct vinput *vinput);
+int vinput_inject(struct vinput *vinput, const struct vinput_record *recs,
+		  int n, unsigned int flags);
+int vinput_get_info(struct vinput *vinput, struct vinput_info *info);
+
+/*
+ * Type drivers report events through these rather than the input_report_*
+ * helpers so that the state page seen by observers follows every frame.
+ */
+void vinput_event(struct vinput *vinput, unsigned int type,
+		  unsigned int code, int value);
+void vinput_sync(struct vinput *vinput);
+
+static inline void vinput_report_key(struct vinput *vinput,
+				     unsigned int code, int value)
+{
+	vinput_event(vinput, EV_KEY, code, !!value);
+}
+
+static inline void vinput_report_rel(struct vinput *vinput,
+				     unsigned int code, int value)
+{
+	vinput_event(vinput, EV_REL, code, value);
+}
+
+static inline void vinput_report_abs(struct vinput *vinput,
+				     unsigned int code, int value)
+{
+	vinput_event(vinput, EV_ABS, code, value);
+}
+
+static inline void vinput_mt_slot(struct vinput *vinput, int slot)
+{
+	vinput_event(vinput, EV_ABS, ABS_MT_SLOT, slot);
+}
+
+static inline void vinput_mt_sync(struct vinput *vinput)
+{
+	vinput_event(vinput, EV_SYN, SYN_MT_REPORT, 0);
+}
+
+/* type B devices, instead of input_mt_report_pointer_emulation */
+void vinput_mt_report_pointer_emulation(struct vinput *vinput);
+
+/* core internals, shared with the configfs interface */
+struct vinput_device *vinput_get_device_by_type(const char *type);
+struct vinput *vinput_export(struct vinput_device *device, const char *config);
+int vinput_unexport(struct vinput *vinput, u64 gen);
+long vinput_exported_id(struct vinput *vinput, u64 gen);
+
+#if IS_ENABLED(CONFIG_CONFIGFS_FS)
+int vinput_configfs_init(void);
+void vinput_configfs_exit(void);
+#else
+static inline int vinput_configfs_init(void)
+{
+	return 0;
+}
+
+static inline void vinput_configfs_exit(void)
+{
+}
+#endif
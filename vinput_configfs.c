@@ -0,0 +1,255 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/configfs.h>
+
+#include "vinput.h"
+
+/*
+ * configfs interface. Each directory under /sys/kernel/config/vinput
+ * defines one device: its type and settings are written first, then
+ * writing 1 to commit exports it in a single step. Removing the
+ * directory unexports the device. One unexported otherwise leaves the
+ * item uncommitted.
+ */
+struct vinput_item {
+	struct config_item item;
+	struct mutex lock;
+	char type[16];
+	char *config;
+	struct vinput *vinput;	/* committed device, not referenced */
+	u64 gen;
+};
+
+static inline struct vinput_item *to_vinput_item(struct config_item *item)
+{
+	return container_of(item, struct vinput_item, item);
+}
+
+/* id of the committed device if still there, vitem->lock held */
+static long vinput_item_id(struct vinput_item *vitem)
+{
+	if (!vitem->vinput)
+		return -ENODEV;
+
+	return vinput_exported_id(vitem->vinput, vitem->gen);
+}
+
+static ssize_t vinput_item_type_show(struct config_item *item, char *page)
+{
+	return sprintf(page, "%s\n", to_vinput_item(item)->type);
+}
+
+static ssize_t vinput_item_type_store(struct config_item *item,
+				      const char *page, size_t len)
+{
+	struct vinput_item *vitem = to_vinput_item(item);
+
+	if (len >= sizeof(vitem->type))
+		return -EINVAL;
+
+	mutex_lock(&vitem->lock);
+	if (vinput_item_id(vitem) >= 0) {
+		mutex_unlock(&vitem->lock);
+		return -EBUSY;
+	}
+	strlcpy(vitem->type, page, sizeof(vitem->type));
+	strim(vitem->type);
+	mutex_unlock(&vitem->lock);
+
+	return len;
+}
+
+static ssize_t vinput_item_config_show(struct config_item *item, char *page)
+{
+	ssize_t len;
+	struct vinput_item *vitem = to_vinput_item(item);
+
+	mutex_lock(&vitem->lock);
+	len = sprintf(page, "%s\n", vitem->config ? vitem->config : "");
+	mutex_unlock(&vitem->lock);
+
+	return len;
+}
+
+/* key=val settings of the device type, comma or newline separated */
+static ssize_t vinput_item_config_store(struct config_item *item,
+					const char *page, size_t len)
+{
+	char *config, *p;
+	struct vinput_item *vitem = to_vinput_item(item);
+
+	config = kstrndup(page, len, GFP_KERNEL);
+	if (!config)
+		return -ENOMEM;
+
+	for (p = config; *p; p++)
+		if (*p == '\n')
+			*p = ',';
+
+	mutex_lock(&vitem->lock);
+	if (vinput_item_id(vitem) >= 0) {
+		mutex_unlock(&vitem->lock);
+		kfree(config);
+		return -EBUSY;
+	}
+	kfree(vitem->config);
+	vitem->config = config;
+	mutex_unlock(&vitem->lock);
+
+	return len;
+}
+
+static ssize_t vinput_item_commit_show(struct config_item *item, char *page)
+{
+	long id;
+	struct vinput_item *vitem = to_vinput_item(item);
+
+	mutex_lock(&vitem->lock);
+	id = vinput_item_id(vitem);
+	mutex_unlock(&vitem->lock);
+
+	return sprintf(page, "%d\n", id >= 0);
+}
+
+static ssize_t vinput_item_commit_store(struct config_item *item,
+					const char *page, size_t len)
+{
+	int err;
+	bool val;
+	struct vinput *vinput;
+	struct vinput_device *device;
+	struct vinput_item *vitem = to_vinput_item(item);
+
+	err = kstrtobool(page, &val);
+	if (err)
+		return err;
+	if (!val)
+		return -EINVAL;
+
+	mutex_lock(&vitem->lock);
+	if (vinput_item_id(vitem) >= 0) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	device = vinput_get_device_by_type(vitem->type);
+	if (IS_ERR(device)) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	vinput = vinput_export(device, vitem->config);
+	if (IS_ERR(vinput)) {
+		err = PTR_ERR(vinput);
+		goto out;
+	}
+
+	vitem->vinput = vinput;
+	vitem->gen = vinput->gen;
+	err = len;
+out:
+	mutex_unlock(&vitem->lock);
+	return err;
+}
+
+static ssize_t vinput_item_id_show(struct config_item *item, char *page)
+{
+	long id;
+	struct vinput_item *vitem = to_vinput_item(item);
+
+	mutex_lock(&vitem->lock);
+	id = vinput_item_id(vitem);
+	mutex_unlock(&vitem->lock);
+
+	return sprintf(page, "%ld\n", id >= 0 ? id : -1L);
+}
+
+CONFIGFS_ATTR(vinput_item_, type);
+CONFIGFS_ATTR(vinput_item_, config);
+CONFIGFS_ATTR(vinput_item_, commit);
+CONFIGFS_ATTR_RO(vinput_item_, id);
+
+static struct configfs_attribute *vinput_item_attrs[] = {
+	&vinput_item_attr_type,
+	&vinput_item_attr_config,
+	&vinput_item_attr_commit,
+	&vinput_item_attr_id,
+	NULL,
+};
+
+static void vinput_item_release(struct config_item *item)
+{
+	struct vinput_item *vitem = to_vinput_item(item);
+
+	kfree(vitem->config);
+	kfree(vitem);
+}
+
+static struct configfs_item_operations vinput_item_ops = {
+	.release = vinput_item_release,
+};
+
+static struct config_item_type vinput_item_type = {
+	.ct_item_ops = &vinput_item_ops,
+	.ct_attrs = vinput_item_attrs,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct config_item *vinput_make_item(struct config_group *group,
+					    const char *name)
+{
+	struct vinput_item *vitem;
+
+	vitem = kzalloc(sizeof(struct vinput_item), GFP_KERNEL);
+	if (!vitem)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_init(&vitem->lock);
+	config_item_init_type_name(&vitem->item, name, &vinput_item_type);
+
+	return &vitem->item;
+}
+
+static void vinput_drop_item(struct config_group *group,
+			     struct config_item *item)
+{
+	struct vinput_item *vitem = to_vinput_item(item);
+
+	mutex_lock(&vitem->lock);
+	if (vitem->vinput)
+		vinput_unexport(vitem->vinput, vitem->gen);
+	vitem->vinput = NULL;
+	mutex_unlock(&vitem->lock);
+
+	config_item_put(item);
+}
+
+static struct configfs_group_operations vinput_group_ops = {
+	.make_item = vinput_make_item,
+	.drop_item = vinput_drop_item,
+};
+
+static struct config_item_type vinput_group_type = {
+	.ct_group_ops = &vinput_group_ops,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem vinput_subsys;
+
+int vinput_configfs_init(void)
+{
+	config_group_init_type_name(&vinput_subsys.su_group, "vinput",
+				    &vinput_group_type);
+	mutex_init(&vinput_subsys.su_mutex);
+
+	return configfs_register_subsystem(&vinput_subsys);
+}
+
+void vinput_configfs_exit(void)
+{
+	configfs_unregister_subsystem(&vinput_subsys);
+}
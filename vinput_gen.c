@@ -0,0 +1,571 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/input.h>
+#include <linux/mutex.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+#include <linux/random.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "vinput.h"
+
+/*
+ * Synthetic load generator. A kthread drives one vinput device with a
+ * pattern at a fixed frame rate, through vinput_inject. Everything is
+ * controlled from /sys/kernel/debug/vinput_gen:
+ *   target   id of the vinputX device
+ *   pattern  keys, circle (vmouse) or touch (vts_mt type B)
+ *   rate     frames per second
+ *   fingers  contacts of the touch pattern
+ *   run      1 to start, 0 to stop
+ *   stats    frames, events, errors, wakeups, achieved rate and jitter
+ *   bench    write a number of frames to time the injection of the
+ *            pattern, read the cost per event of each path
+ */
+#define VINPUT_GEN_FRAME	64	/* records per frame */
+#define VINPUT_GEN_FINGERS	10
+#define VINPUT_GEN_SLACK_NS	10000
+#define VINPUT_GEN_BATCH	256	/* records per batched injection */
+#define VINPUT_GEN_BENCH_MAX	1000000	/* frames per bench run */
+
+enum vinput_gen_pattern {
+	VINPUT_GEN_KEYS,
+	VINPUT_GEN_CIRCLE,
+	VINPUT_GEN_TOUCH,
+};
+
+static const char * const vinput_gen_patterns[] = {
+	[VINPUT_GEN_KEYS] = "keys",
+	[VINPUT_GEN_CIRCLE] = "circle",
+	[VINPUT_GEN_TOUCH] = "touch",
+};
+
+/* a circle of 16 points, cos and sin scaled by 1000 */
+static const short vinput_gen_cos[16] = {
+	1000, 924, 707, 383, 0, -383, -707, -924,
+	-1000, -924, -707, -383, 0, 383, 707, 924,
+};
+
+#define vinput_gen_sin(i)	vinput_gen_cos[((i) + 12) % 16]
+
+struct vinput_gen_stats {
+	u64 frames;
+	u64 events;
+	u64 errors;
+	u64 start;
+	u64 end;
+	u64 wakeups;
+	u64 late_total;	/* wakeup lateness, ns */
+	u64 late_max;
+};
+
+/* what a frame is made of, the axis limits read once from the device */
+struct vinput_gen_conf {
+	u32 pattern;
+	u32 fingers;
+	int cx, cy;	/* touch: center of the surface */
+};
+
+static DEFINE_MUTEX(vinput_gen_lock);
+static struct task_struct *vinput_gen_task;
+static struct vinput *vinput_gen_target;
+static struct vinput_record *vinput_gen_recs;
+static struct dentry *vinput_gen_dir;
+static struct vinput_gen_stats vinput_gen_stats;
+
+static u32 target;
+static u32 pattern = VINPUT_GEN_KEYS;
+static u32 rate = 100;
+static u32 fingers = 2;
+
+/* settings of the running generator, checked by vinput_gen_start */
+static struct vinput_gen_conf vinput_gen_conf;
+static u32 vinput_gen_period;
+
+static void vinput_gen_rec(struct vinput_record *rec, unsigned int type,
+			   unsigned int code, int value)
+{
+	rec->type = type;
+	rec->code = code;
+	rec->value = value;
+}
+
+/* check the pattern against the device, called with vinput_gen_lock held */
+static int vinput_gen_setup(struct vinput *vinput,
+			    struct vinput_gen_conf *conf)
+{
+	int err;
+	struct vinput_info info;
+
+	if (!fingers || fingers > VINPUT_GEN_FINGERS ||
+	    pattern >= ARRAY_SIZE(vinput_gen_patterns))
+		return -EINVAL;
+
+	conf->pattern = pattern;
+	conf->fingers = fingers;
+	if (pattern != VINPUT_GEN_TOUCH)
+		return 0;
+
+	err = vinput_get_info(vinput, &info);
+	if (err)
+		return err;
+	if (info.max_x < 0 || info.max_y < 0)
+		return -EINVAL;
+	conf->cx = info.max_x / 2;
+	conf->cy = info.max_y / 2;
+
+	return 0;
+}
+
+/* fill the records of frame n, returns their number */
+static int vinput_gen_frame(const struct vinput_gen_conf *conf,
+			    struct vinput_record *recs, u64 n)
+{
+	int i, k, r;
+	int count = 0;
+	static unsigned int key;
+
+	switch (conf->pattern) {
+	case VINPUT_GEN_KEYS:
+		/* press a random letter of the top row, release it next */
+		if (n % 2 == 0)
+			key = KEY_Q + prandom_u32() % (KEY_P - KEY_Q + 1);
+		vinput_gen_rec(&recs[count++], EV_KEY, key, n % 2 == 0);
+		break;
+	case VINPUT_GEN_CIRCLE:
+		/* relative moves along a circle of radius 100 */
+		i = n % 16;
+		k = (i + 1) % 16;
+		vinput_gen_rec(&recs[count++], EV_REL, REL_X,
+			       (vinput_gen_cos[k] - vinput_gen_cos[i]) / 10);
+		vinput_gen_rec(&recs[count++], EV_REL, REL_Y,
+			       (vinput_gen_sin(k) - vinput_gen_sin(i)) / 10);
+		break;
+	case VINPUT_GEN_TOUCH:
+		/* fingers spread on a circle turning around the center */
+		r = min(conf->cx, conf->cy) / 2;
+		for (i = 0; i < conf->fingers; i++) {
+			k = (n + i * 16 / conf->fingers) % 16;
+			vinput_gen_rec(&recs[count++], EV_ABS, ABS_MT_SLOT, i);
+			vinput_gen_rec(&recs[count++], EV_ABS,
+				       ABS_MT_TRACKING_ID, i);
+			vinput_gen_rec(&recs[count++], EV_ABS,
+				       ABS_MT_POSITION_X,
+				       conf->cx + r * vinput_gen_cos[k] / 1000);
+			vinput_gen_rec(&recs[count++], EV_ABS,
+				       ABS_MT_POSITION_Y,
+				       conf->cy + r * vinput_gen_sin(k) / 1000);
+		}
+		break;
+	}
+
+	vinput_gen_rec(&recs[count++], EV_SYN, SYN_REPORT, 0);
+
+	return count;
+}
+
+static int vinput_gen_thread(void *data)
+{
+	int i, n, err;
+	u64 now, late;
+	ktime_t next = ktime_get();
+	u64 period = vinput_gen_period;
+	struct vinput *vinput = data;
+	struct vinput_gen_stats *stats = &vinput_gen_stats;
+	struct vinput_gen_conf conf = vinput_gen_conf;
+	struct vinput_record *recs = vinput_gen_recs;
+
+	stats->start = ktime_get_ns();
+	while (!kthread_should_stop()) {
+		next = ktime_add_ns(next, period);
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout_range(&next, VINPUT_GEN_SLACK_NS,
+					 HRTIMER_MODE_ABS);
+		if (kthread_should_stop())
+			break;
+
+		now = ktime_get_ns();
+		late = now > ktime_to_ns(next) ? now - ktime_to_ns(next) : 0;
+		stats->wakeups++;
+		stats->late_total += late;
+		if (late > stats->late_max)
+			stats->late_max = late;
+
+		/* do not try to catch up after a long stall */
+		if (late > period)
+			next = ns_to_ktime(now);
+
+		n = vinput_gen_frame(&conf, recs, stats->frames);
+		err = vinput_inject(vinput, recs, n, VINPUT_INJECT_NONBLOCK);
+		if (err < 0) {
+			stats->errors++;
+			if (err == -ENODEV)
+				break;
+			continue;
+		}
+		stats->frames++;
+		stats->events += n;
+	}
+	stats->end = ktime_get_ns();
+
+	/* lift the contacts and release the key left down */
+	n = 0;
+	if (conf.pattern == VINPUT_GEN_TOUCH) {
+		for (i = 0; i < conf.fingers; i++) {
+			vinput_gen_rec(&recs[n++], EV_ABS, ABS_MT_SLOT, i);
+			vinput_gen_rec(&recs[n++], EV_ABS, ABS_MT_TRACKING_ID, -1);
+		}
+	} else if (conf.pattern == VINPUT_GEN_KEYS && stats->frames % 2) {
+		n = vinput_gen_frame(&conf, recs, stats->frames) - 1;
+	}
+	if (n) {
+		vinput_gen_rec(&recs[n++], EV_SYN, SYN_REPORT, 0);
+		vinput_inject(vinput, recs, n, 0);
+	}
+
+	/* wait for vinput_gen_stop when the device went away */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static int vinput_gen_start(void)
+{
+	int err;
+	struct vinput *vinput;
+	struct task_struct *task;
+
+	if (vinput_gen_task)
+		return -EBUSY;
+	if (!rate || rate > NSEC_PER_SEC)
+		return -EINVAL;
+
+	vinput = vinput_get(target);
+	if (IS_ERR(vinput))
+		return PTR_ERR(vinput);
+
+	err = vinput_gen_setup(vinput, &vinput_gen_conf);
+	if (err)
+		goto fail;
+
+	vinput_gen_recs = kmalloc_array(VINPUT_GEN_FRAME,
+					sizeof(*vinput_gen_recs), GFP_KERNEL);
+	if (!vinput_gen_recs) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	vinput_gen_period = NSEC_PER_SEC / rate;
+	memset(&vinput_gen_stats, 0, sizeof(vinput_gen_stats));
+	task = kthread_run(vinput_gen_thread, vinput, "vinput_gen");
+	if (IS_ERR(task)) {
+		err = PTR_ERR(task);
+		goto fail_recs;
+	}
+
+	vinput_gen_task = task;
+	vinput_gen_target = vinput;
+
+	return 0;
+
+fail_recs:
+	kfree(vinput_gen_recs);
+	vinput_gen_recs = NULL;
+fail:
+	vinput_put(vinput);
+	return err;
+}
+
+static void vinput_gen_stop(void)
+{
+	if (!vinput_gen_task)
+		return;
+
+	kthread_stop(vinput_gen_task);
+	vinput_put(vinput_gen_target);
+	kfree(vinput_gen_recs);
+	vinput_gen_task = NULL;
+	vinput_gen_target = NULL;
+	vinput_gen_recs = NULL;
+}
+
+/*
+ * Micro-benchmark of the injection paths, run synchronously with the
+ * current target, pattern and fingers: one vinput_inject call per frame,
+ * then as many whole frames as fit in VINPUT_GEN_BATCH records per call.
+ * Runs of up to VINPUT_GEN_BENCH_MAX frames, a fatal signal ends them.
+ */
+static u64 vinput_gen_bench_frames;
+static u64 vinput_gen_bench_frame_ns;	/* per event */
+static u64 vinput_gen_bench_batch_ns;
+
+static int vinput_gen_bench(u64 frames)
+{
+	int n, err = 0;
+	u64 i, start, events;
+	unsigned int count;
+	struct vinput *vinput;
+	struct vinput_record *recs;
+	struct vinput_gen_conf conf;
+
+	if (vinput_gen_task)
+		return -EBUSY;
+	if (!frames || frames > VINPUT_GEN_BENCH_MAX)
+		return -EINVAL;
+
+	recs = kmalloc_array(VINPUT_GEN_BATCH, sizeof(*recs), GFP_KERNEL);
+	if (!recs)
+		return -ENOMEM;
+
+	vinput = vinput_get(target);
+	if (IS_ERR(vinput)) {
+		kfree(recs);
+		return PTR_ERR(vinput);
+	}
+
+	err = vinput_gen_setup(vinput, &conf);
+	if (err)
+		goto out;
+
+	/* key presses come with their release */
+	frames = round_up(frames, 2);
+
+	events = 0;
+	start = ktime_get_ns();
+	for (i = 0; i < frames; i++) {
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			goto out;
+		}
+		n = vinput_gen_frame(&conf, recs, i);
+		err = vinput_inject(vinput, recs, n, 0);
+		if (err < 0)
+			goto out;
+		events += n;
+	}
+	vinput_gen_bench_frame_ns = div64_u64(ktime_get_ns() - start, events);
+
+	events = 0;
+	start = ktime_get_ns();
+	for (i = 0; i < frames; ) {
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			goto out;
+		}
+		count = 0;
+		while (i < frames && count + VINPUT_GEN_FRAME <= VINPUT_GEN_BATCH)
+			count += vinput_gen_frame(&conf, recs + count, i++);
+		err = vinput_inject(vinput, recs, count, 0);
+		if (err < 0)
+			goto out;
+		events += count;
+	}
+	vinput_gen_bench_batch_ns = div64_u64(ktime_get_ns() - start, events);
+	vinput_gen_bench_frames = frames;
+	err = 0;
+out:
+	vinput_put(vinput);
+	kfree(recs);
+
+	return err;
+}
+
+static ssize_t vinput_gen_bench_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	char val[96];
+	int len;
+
+	len = snprintf(val, sizeof(val), "frames %llu\nframe %llu\nbatch %llu\n",
+		       vinput_gen_bench_frames, vinput_gen_bench_frame_ns,
+		       vinput_gen_bench_batch_ns);
+
+	return simple_read_from_buffer(buf, count, ppos, val, len);
+}
+
+static ssize_t vinput_gen_bench_write(struct file *file,
+				      const char __user *buf, size_t count,
+				      loff_t *ppos)
+{
+	int err;
+	u64 frames;
+
+	err = kstrtou64_from_user(buf, count, 10, &frames);
+	if (err)
+		return err;
+
+	mutex_lock(&vinput_gen_lock);
+	err = vinput_gen_bench(frames);
+	mutex_unlock(&vinput_gen_lock);
+
+	return err ? err : count;
+}
+
+static const struct file_operations vinput_gen_bench_fops = {
+	.owner = THIS_MODULE,
+	.read = vinput_gen_bench_read,
+	.write = vinput_gen_bench_write,
+};
+
+static ssize_t vinput_gen_run_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	char val[3];
+
+	val[0] = vinput_gen_task ? '1' : '0';
+	val[1] = '\n';
+	val[2] = '\0';
+
+	return simple_read_from_buffer(buf, count, ppos, val, 2);
+}
+
+static ssize_t vinput_gen_run_write(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	int err = 0;
+	bool run;
+	char val[8] = { 0 };
+
+	if (copy_from_user(val, buf, min(count, sizeof(val) - 1)))
+		return -EFAULT;
+
+	err = kstrtobool(val, &run);
+	if (err)
+		return err;
+
+	mutex_lock(&vinput_gen_lock);
+	if (run)
+		err = vinput_gen_start();
+	else
+		vinput_gen_stop();
+	mutex_unlock(&vinput_gen_lock);
+
+	return err ? err : count;
+}
+
+static const struct file_operations vinput_gen_run_fops = {
+	.owner = THIS_MODULE,
+	.read = vinput_gen_run_read,
+	.write = vinput_gen_run_write,
+};
+
+static ssize_t vinput_gen_pattern_read(struct file *file, char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	char val[16];
+	int len;
+
+	len = snprintf(val, sizeof(val), "%s\n", vinput_gen_patterns[pattern]);
+
+	return simple_read_from_buffer(buf, count, ppos, val, len);
+}
+
+static ssize_t vinput_gen_pattern_write(struct file *file,
+					const char __user *buf, size_t count,
+					loff_t *ppos)
+{
+	int i;
+	int err = -EINVAL;
+	char val[16] = { 0 };
+
+	if (copy_from_user(val, buf, min(count, sizeof(val) - 1)))
+		return -EFAULT;
+
+	mutex_lock(&vinput_gen_lock);
+	for (i = 0; i < ARRAY_SIZE(vinput_gen_patterns); i++) {
+		if (sysfs_streq(val, vinput_gen_patterns[i])) {
+			err = vinput_gen_task ? -EBUSY : 0;
+			if (!err)
+				pattern = i;
+			break;
+		}
+	}
+	mutex_unlock(&vinput_gen_lock);
+
+	return err ? err : count;
+}
+
+static const struct file_operations vinput_gen_pattern_fops = {
+	.owner = THIS_MODULE,
+	.read = vinput_gen_pattern_read,
+	.write = vinput_gen_pattern_write,
+};
+
+/* achieved rate in frames/s, mean and max lateness of the wakeups in ns */
+static int vinput_gen_stats_show(struct seq_file *s, void *unused)
+{
+	u64 elapsed;
+	struct vinput_gen_stats stats = vinput_gen_stats;
+
+	elapsed = (vinput_gen_task && !stats.end ? ktime_get_ns() : stats.end) -
+		  stats.start;
+
+	seq_printf(s, "frames %llu\n", stats.frames);
+	seq_printf(s, "events %llu\n", stats.events);
+	seq_printf(s, "errors %llu\n", stats.errors);
+	seq_printf(s, "wakeups %llu\n", stats.wakeups);
+	seq_printf(s, "rate %llu\n", stats.start && elapsed ?
+		   div64_u64(stats.frames * NSEC_PER_SEC, elapsed) : 0);
+	seq_printf(s, "jitter_avg %llu\n", stats.wakeups ?
+		   div64_u64(stats.late_total, stats.wakeups) : 0);
+	seq_printf(s, "jitter_max %llu\n", stats.late_max);
+
+	return 0;
+}
+
+static int vinput_gen_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vinput_gen_stats_show, NULL);
+}
+
+static const struct file_operations vinput_gen_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = vinput_gen_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init vinput_gen_init(void)
+{
+	vinput_gen_dir = debugfs_create_dir("vinput_gen", NULL);
+	if (IS_ERR_OR_NULL(vinput_gen_dir))
+		return -ENODEV;
+
+	debugfs_create_u32("target", 0644, vinput_gen_dir, &target);
+	debugfs_create_u32("rate", 0644, vinput_gen_dir, &rate);
+	debugfs_create_u32("fingers", 0644, vinput_gen_dir, &fingers);
+	debugfs_create_file("pattern", 0644, vinput_gen_dir, NULL,
+			    &vinput_gen_pattern_fops);
+	debugfs_create_file("run", 0644, vinput_gen_dir, NULL,
+			    &vinput_gen_run_fops);
+	debugfs_create_file("stats", 0444, vinput_gen_dir, NULL,
+			    &vinput_gen_stats_fops);
+	debugfs_create_file("bench", 0644, vinput_gen_dir, NULL,
+			    &vinput_gen_bench_fops);
+
+	return 0;
+}
+
+static void __exit vinput_gen_end(void)
+{
+	debugfs_remove_recursive(vinput_gen_dir);
+
+	mutex_lock(&vinput_gen_lock);
+	vinput_gen_stop();
+	mutex_unlock(&vinput_gen_lock);
+}
+
+module_init(vinput_gen_init);
+module_exit(vinput_gen_end);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("synthetic input load generator for vinput devices");
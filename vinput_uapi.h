@@ -0,0 +1,164 @@
+#ifndef _VINPUT_UAPI_H
+#define _VINPUT_UAPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/input.h>
+
+/*
+ * Binary record written to the vinput control node (/dev/vinputctl).
+ * id selects the vinputX device, type/code/value have the same meaning
+ * as in struct input_event.
+ */
+struct vinput_record {
+	__u32 id;
+	__u16 type;
+	__u16 code;
+	__s32 value;
+};
+
+/*
+ * Snapshot of a device input state, shared with userspace through mmap.
+ * seq works like a seqcount: the writer makes it odd, updates the page and
+ * makes it even again. keys holds one bit per KEY_/BTN_ code, x/y/wheel the
+ * accumulated pointer position and contacts one touch per slot, a slot with
+ * z == 0 being released. completed and failed are the sequence numbers of
+ * the last completed batch and of the last one that failed, and are only
+ * maintained in the state page.
+ */
+#define VINPUT_STATE_KEYS	((KEY_CNT + 63) / 64)
+#define VINPUT_STATE_CONTACTS	16
+
+struct vinput_contact {
+	__s32 id;
+	__s32 x;
+	__s32 y;
+	__s32 z;
+};
+
+struct vinput_state {
+	__u32 seq;
+	__u32 flags;
+	__u64 keys[VINPUT_STATE_KEYS];
+	__s32 x;
+	__s32 y;
+	__s32 wheel;
+	struct vinput_contact contacts[VINPUT_STATE_CONTACTS];
+	__u32 reserved;
+	__u64 completed;
+	__u64 failed;
+};
+
+/*
+ * mmap offsets (in pages) on /dev/vinputX. Mapping the desired state page
+ * switches the device to desired state mode: userspace overwrites the page
+ * and the kernel emits the transitions on its next tick. The state page is
+ * read-only and reflects the state after the last frame sent to the device.
+ */
+#define VINPUT_MMAP_DESIRED	0
+#define VINPUT_MMAP_STATE	1
+
+/*
+ * Timed record for the VINPUT_FORMAT_TIMED format of the control node.
+ * time is an absolute CLOCK_MONOTONIC timestamp in ns, flags must be 0.
+ * Records are queued on their device and played back by the kernel at
+ * the given time, in submission order.
+ */
+struct vinput_timed_record {
+	__u64 time;
+	struct vinput_record rec;
+	__u32 flags;
+};
+
+#define VINPUT_FORMAT_RECORD	0
+#define VINPUT_FORMAT_TIMED	1
+#define VINPUT_FORMAT_TEXT	2
+
+/*
+ * /dev/vinputX fds take the text format of their device type by default.
+ * In VINPUT_FORMAT_RECORD a write is an array of struct vinput_record
+ * (rec.id is ignored) emitted at once, the last frame being synced.
+ * In VINPUT_FORMAT_TIMED each fd is a stream of timed records (rec.id is
+ * ignored), and the streams of a device are merged in timestamp order.
+ */
+
+#define VINPUT_IOC_MAGIC	'v'
+
+/*
+ * Transactions on the control node: after TXN_BEGIN, records written to
+ * the fd are staged instead of injected. TXN_COMMIT emits all of them
+ * back-to-back in staging order, syncing a device each time the stream
+ * moves on to another one. TXN_ABORT drops the staged records.
+ */
+#define VINPUT_IOC_TXN_BEGIN	_IO(VINPUT_IOC_MAGIC, 0x01)
+#define VINPUT_IOC_TXN_COMMIT	_IO(VINPUT_IOC_MAGIC, 0x02)
+#define VINPUT_IOC_TXN_ABORT	_IO(VINPUT_IOC_MAGIC, 0x03)
+
+/* select the record format written to the control node fd */
+#define VINPUT_IOC_SET_FORMAT	_IO(VINPUT_IOC_MAGIC, 0x04)
+
+/*
+ * Priority lane on the control node: records points to count struct
+ * vinput_record emitted at once, ahead of the queued events of their
+ * devices and regardless of their rate limits. With FLUSH the queued
+ * events of these devices are dropped first and their batches completed,
+ * with RELEASE_ALL their pressed keys are released and contacts lifted.
+ */
+struct vinput_urgent {
+	__u64 records;
+	__u32 count;
+	__u32 flags;
+};
+
+#define VINPUT_URGENT_FLUSH		(1 << 0)
+#define VINPUT_URGENT_RELEASE_ALL	(1 << 1)
+
+#define VINPUT_IOC_URGENT	_IOW(VINPUT_IOC_MAGIC, 0x05, struct vinput_urgent)
+
+/*
+ * Capabilities of a /dev/vinputX device. formats has one bit per
+ * VINPUT_FORMAT_* accepted by the fd, evbit one bit per supported EV_*
+ * type. The limits are in records, except max_text in bytes. Type specific
+ * limits are -1 when they do not apply or are not set yet.
+ */
+#define VINPUT_ABI_VERSION	1
+
+#define VINPUT_INFO_REGISTERED	(1 << 0)	/* input device registered */
+
+struct vinput_info {
+	__u32 version;
+	__u32 flags;
+	__u32 formats;
+	__u32 max_text;
+	__u32 max_txn;
+	__u32 max_urgent;
+	__u32 queue_depth;
+	__u32 batch_size;
+	__u64 evbit;
+	char type[16];
+	__s32 max_x;
+	__s32 max_y;
+	__s32 max_z;
+	__s32 max_points;
+};
+
+#define VINPUT_IOC_GET_INFO	_IOR(VINPUT_IOC_MAGIC, 0x06, struct vinput_info)
+
+/*
+ * Batch completion on /dev/vinputX. Each write to the device, and each
+ * device touched by a control node write, is a batch numbered from 1.
+ * SET_EVENTFD takes an eventfd (or -1) signaled once per completed batch,
+ * GET_SEQ returns the last submitted and completed sequence numbers, and
+ * the last one of a batch that failed or was dropped, which also counts as
+ * completed.
+ */
+struct vinput_seq {
+	__u64 submitted;
+	__u64 completed;
+	__u64 failed;
+};
+
+#define VINPUT_IOC_SET_EVENTFD	_IO(VINPUT_IOC_MAGIC, 0x10)
+#define VINPUT_IOC_GET_SEQ	_IOR(VINPUT_IOC_MAGIC, 0x11, struct vinput_seq)
+
+#endif /* _VINPUT_UAPI_H */
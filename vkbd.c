@@ -25,7 +25,7 @@ static int vinput_vkbd_init(struct vinput *vinput)
 	for (i = 0; i < KEY_MAX; i++)
 		set_bit(vkeymap[i], vinput->input->keybit);
 
-	return input_register_device(vinput->input);
+	return vinput_register_input(vinput);
 }
 
 static int vinput_vkbd_read(struct vinput *vinput, char *buff, int len)
@@ -47,8 +47,13 @@ static int vinput_vkbd_send(struct vinput *vinput, char *buff, int len)
 		ret = kstrtol(buff + 1, 10, &key);
 	else
 		ret = kstrtol(buff, 10, &key);
-	if (ret)
-		dev_err(&vinput->dev, "error during kstrtol: -%d\n", ret);
+	if (ret) {
+		dev_err(&vinput->dev, "error during kstrtol: %d\n", ret);
+		return ret;
+	}
+	if (key >= KEY_MAX || key <= -KEY_MAX)
+		return -EINVAL;
+
 	spin_lock(&vinput->lock);
 	vinput->last_entry = key;
 	spin_unlock(&vinput->lock);
@@ -58,24 +63,52 @@ static int vinput_vkbd_send(struct vinput *vinput, char *buff, int len)
 		key = -key;
 	}
 
-	dev_info(&vinput->dev, "Event %s code %ld\n",
+	dev_dbg(&vinput->dev, "Event %s code %ld\n",
 		 (type == VINPUT_RELEASE) ? "VINPUT_RELEASE" : "VINPUT_PRESS",
 		 key);
 
-	input_report_key(vinput->input, key, type);
-	input_sync(vinput->input);
+	vinput_report_key(vinput, key, type);
+	vinput_sync(vinput);
 
 	return len;
 }
 
+/* binary records, read reports the last key as for the text format */
+static int vinput_vkbd_send_batch(struct vinput *vinput,
+				  const struct vinput_record *recs, int n)
+{
+	int i;
+	long last = 0;
+
+	for (i = 0; i < n; i++) {
+		if (recs[i].type == EV_KEY)
+			last = recs[i].value ? recs[i].code : -recs[i].code;
+		if (recs[i].type == EV_SYN && recs[i].code == SYN_REPORT)
+			vinput_sync(vinput);
+		else
+			vinput_event(vinput, recs[i].type, recs[i].code,
+				     recs[i].value);
+	}
+
+	if (last) {
+		spin_lock(&vinput->lock);
+		vinput->last_entry = last;
+		spin_unlock(&vinput->lock);
+	}
+
+	return 0;
+}
+
 static struct vinput_ops vkbd_ops = {
 	.init = vinput_vkbd_init,
 	.send = vinput_vkbd_send,
 	.read = vinput_vkbd_read,
+	.send_batch = vinput_vkbd_send_batch,
 };
 
 static struct vinput_device vkbd_dev = {
 	.name = VINPUT_KBD,
+	.owner = THIS_MODULE,
 	.ops = &vkbd_ops,
 };
 
@@ -11,10 +11,12 @@
 
 #define VINPUT_MTS "vmouse"
 
+struct vmouse_data {
+	int buttons;
+};
+
 static int vinput_vmouse_init(struct vinput *vinput)
 {
-	int *buttons = kmalloc(sizeof(int), GFP_KERNEL);
-
 	__set_bit(EV_REL, vinput->input->evbit);
 	__set_bit(REL_X, vinput->input->relbit);
 	__set_bit(REL_Y, vinput->input->relbit);
@@ -25,17 +27,7 @@ static int vinput_vmouse_init(struct vinput *vinput)
 	__set_bit(BTN_RIGHT, vinput->input->keybit);
 	__set_bit(BTN_MIDDLE, vinput->input->keybit);
 
-	*buttons = 0;
-	vinput->priv_data = buttons;
-
-	return input_register_device(vinput->input);
-}
-
-static int vinput_vmouse_kill(struct vinput *vinput)
-{
-	int *buttons = vinput->priv_data;
-	kfree(buttons);
-	return 0;
+	return vinput_register_input(vinput);
 }
 
 static int vinput_vmouse_read(struct vinput *vinput, char *buff, int len)
@@ -52,7 +44,7 @@ static int vinput_vmouse_send(struct vinput *vinput, char *buff, int len)
 	int ret;
 	int x, y, wheel;
 	int buttons;
-	int *state = vinput->priv_data;
+	struct vmouse_data *drvdata = vinput->priv_data;
 
 	ret = sscanf(buff, "%d,%d,%d,%d", &x, &y, &wheel, &buttons);
 	if (ret != 4) {
@@ -60,22 +52,23 @@ static int vinput_vmouse_send(struct vinput *vinput, char *buff, int len)
 		len = -EINVAL;
 	} else {
 		if (x)
-			input_report_rel(vinput->input, REL_X, x);
+			vinput_report_rel(vinput, REL_X, x);
 		if (y)
-			input_report_rel(vinput->input, REL_Y, y);
+			vinput_report_rel(vinput, REL_Y, y);
 		if (wheel)
-			input_report_rel(vinput->input, REL_WHEEL, wheel);
+			vinput_report_rel(vinput, REL_WHEEL, wheel);
 
-		if ((*state | buttons) & (0x1 << VBUTTON_LEFT))
-			input_report_key(vinput->input, BTN_LEFT, 1 & (buttons >> VBUTTON_LEFT));
-		else if ((*state | buttons) & (0x1 << VBUTTON_RIGHT))
-			input_report_key(vinput->input, BTN_RIGHT, 1 & (buttons >> VBUTTON_RIGHT));
-		else if ((*state | buttons) & (0x1 << VBUTTON_MIDDLE))
-			input_report_key(vinput->input, BTN_MIDDLE, 1 & (buttons >> VBUTTON_MIDDLE));
+		/* each button changes on its own */
+		if ((drvdata->buttons ^ buttons) & (0x1 << VBUTTON_LEFT))
+			vinput_report_key(vinput, BTN_LEFT, 1 & (buttons >> VBUTTON_LEFT));
+		if ((drvdata->buttons ^ buttons) & (0x1 << VBUTTON_RIGHT))
+			vinput_report_key(vinput, BTN_RIGHT, 1 & (buttons >> VBUTTON_RIGHT));
+		if ((drvdata->buttons ^ buttons) & (0x1 << VBUTTON_MIDDLE))
+			vinput_report_key(vinput, BTN_MIDDLE, 1 & (buttons >> VBUTTON_MIDDLE));
 
-		*state = buttons;
+		drvdata->buttons = buttons;
 
-		input_sync(vinput->input);
+		vinput_sync(vinput);
 	}
 
 	return len;
@@ -83,14 +76,15 @@ static int vinput_vmouse_send(struct vinput *vinput, char *buff, int len)
 
 static struct vinput_ops vmouse_ops = {
 	.init = vinput_vmouse_init,
-	.kill = vinput_vmouse_kill,
 	.send = vinput_vmouse_send,
 	.read = vinput_vmouse_read,
 };
 
 static struct vinput_device vmouse_dev = {
 	.name = VINPUT_MTS,
+	.owner = THIS_MODULE,
 	.ops = &vmouse_ops,
+	.priv_size = sizeof(struct vmouse_data),
 };
 
 static int __init vmouse_init(void)
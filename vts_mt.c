@@ -33,6 +33,7 @@ static struct device_attribute vts_mt_attrs[];
 struct mtslot {
 	int updated;
 	int id;
+	int prev_id;	/* before the write being parsed */
 	int x;
 	int y;
 	int z;
@@ -55,10 +56,10 @@ struct vts_mt_data {
 	struct mtslot *slots;
 };
 
-static void vinput_vts_mt_register_final(struct device *dev)
+static int vinput_vts_mt_register_final(struct device *dev)
 {
 	int i;
-	int err = 0;
+	int err;
 	struct vinput *vinput = dev_to_vinput(dev);
 	struct vts_mt_data *drvdata = (struct vts_mt_data *)vinput->priv_data;
 
@@ -70,22 +71,34 @@ static void vinput_vts_mt_register_final(struct device *dev)
 	input_set_abs_params(vinput->input, ABS_MT_PRESSURE, 0, drvdata->max_z, 0, 0);
 
 	drvdata->slots = kzalloc(sizeof(struct mtslot) * drvdata->max_points, GFP_KERNEL);
+	if (!drvdata->slots)
+		return -ENOMEM;
 	for (i = 0; i < drvdata->max_points; i++)
 		drvdata->slots[i].id = -1;
 
-	if (drvdata->type == TYPE_B)
-		input_mt_init_slots(vinput->input, drvdata->max_points, 0);
+	if (drvdata->type == TYPE_B) {
+		err = input_mt_init_slots(vinput->input, drvdata->max_points, 0);
+		if (err)
+			goto fail;
+	}
 
-	if (input_register_device(vinput->input)) {
+	err = vinput_register_input(vinput);
+	if (err) {
 		dev_err(&vinput->dev, "cannot register vinput input device\n");
-		err = -ENODEV;
+		goto fail;
 	}
 	drvdata->registered = 1;
-	
-	return;
+
+	return 0;
+
+	/* the calibration can be written again to retry */
+fail:
+	kfree(drvdata->slots);
+	drvdata->slots = NULL;
+	return err;
 }
 
-static void vinput_vts_mt_calib_done(struct device *dev, int flag)
+static int vinput_vts_mt_calib_done(struct device *dev, int flag)
 {
 	struct vinput *vinput = dev_to_vinput(dev);
 	struct vts_mt_data *drvdata = (struct vts_mt_data *)vinput->priv_data;
@@ -93,7 +106,9 @@ static void vinput_vts_mt_calib_done(struct device *dev, int flag)
 	drvdata->init_flag |= (1 << flag);
 
 	if ((drvdata->init_flag & VTS_MT_CALIB_DONE) == VTS_MT_CALIB_DONE)
-		vinput_vts_mt_register_final(dev);
+		return vinput_vts_mt_register_final(dev);
+
+	return 0;
 }
 
 static ssize_t type_show(struct device *dev, struct device_attribute *attr, char *buf)
@@ -109,14 +124,10 @@ static ssize_t type_show(struct device *dev, struct device_attribute *attr, char
 	return sprintf(buf, "%c\n", drvdata->type == TYPE_A ? 'A':'B');
 };
 
-static ssize_t type_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+static int vinput_vts_mt_set_type(struct vinput *vinput, const char *buf)
 {
-	struct vinput *vinput = dev_to_vinput(dev);
 	struct vts_mt_data *drvdata = (struct vts_mt_data *)vinput->priv_data;
 
-	if (!drvdata)
-		return 0;
-
 	if (drvdata->registered)
 		return -EPERM;
 
@@ -127,7 +138,20 @@ static ssize_t type_store(struct device *dev, struct device_attribute *attr, con
 	else
 		return -EPROTONOSUPPORT;
 
-	vinput_vts_mt_calib_done(dev, calib_type);
+	return vinput_vts_mt_calib_done(&vinput->dev, calib_type);
+}
+
+static ssize_t type_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	int err;
+	struct vinput *vinput = dev_to_vinput(dev);
+
+	if (!vinput->priv_data)
+		return 0;
+
+	err = vinput_vts_mt_set_type(vinput, buf);
+	if (err < 0)
+		return err;
 
 	return size;
 };
@@ -164,17 +188,14 @@ static ssize_t calib_show(struct device *dev, struct device_attribute *attr, cha
 	return -EINVAL;
 };
 
-static ssize_t calib_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+static int vinput_vts_mt_set_calib(struct vinput *vinput,
+				   enum vts_mt_attributes which, const char *buf)
 {
 	int val;
 	int flag;
 	int status;
-	struct vinput *vinput = dev_to_vinput(dev);
 	struct vts_mt_data *drvdata = (struct vts_mt_data *)vinput->priv_data;
 
-	if (!drvdata)
-		return 0;
-
 	if (drvdata->registered)
 		return -EPERM;
 
@@ -182,23 +203,41 @@ static ssize_t calib_store(struct device *dev, struct device_attribute *attr, co
 	if (status < 0)
 		return status;
 
-	if (attr == &vts_mt_attrs[attr_max_x]) {
+	switch (which) {
+	case attr_max_x:
 		drvdata->max_x = val;
 		flag = calib_x;
-	} else if (attr == &vts_mt_attrs[attr_max_y]) {
+		break;
+	case attr_max_y:
 		drvdata->max_y = val;
 		flag = calib_y;
-	} else if (attr == &vts_mt_attrs[attr_max_z]) {
+		break;
+	case attr_max_z:
 		drvdata->max_z = val;
 		flag = calib_z;
-	} else if (attr == &vts_mt_attrs[attr_max_points]) {
+		break;
+	case attr_max_points:
 		drvdata->max_points = val;
 		flag = calib_points;
-	} else {
+		break;
+	default:
 		return -EPROTO;
 	}
 
-	vinput_vts_mt_calib_done(dev, flag);
+	return vinput_vts_mt_calib_done(&vinput->dev, flag);
+}
+
+static ssize_t calib_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t size)
+{
+	int err;
+	struct vinput *vinput = dev_to_vinput(dev);
+
+	if (!vinput->priv_data)
+		return 0;
+
+	err = vinput_vts_mt_set_calib(vinput, attr - vts_mt_attrs, buf);
+	if (err < 0)
+		return err;
 
 	return size;
 };
@@ -215,19 +254,14 @@ static struct device_attribute vts_mt_attrs[] = {
 static int vinput_vts_mt_init(struct vinput *vinput)
 {
 	int err = 0;
-	struct vts_mt_data *drvdata;
+	struct vts_mt_data *drvdata = (struct vts_mt_data *)vinput->priv_data;
 	struct device_attribute *attr = vts_mt_attrs;
 
-	drvdata = kmalloc(sizeof(struct vts_mt_data), GFP_KERNEL);
-	vinput->priv_data = drvdata;
-	
-	drvdata->registered = 0;
-	drvdata->init_flag = 0;
 	drvdata->type = TYPE_NONE;
 	drvdata->max_x = -1;
 	drvdata->max_y = -1;
+	drvdata->max_z = -1;
 	drvdata->max_points = -1;
-	drvdata->slots = NULL;
 
 	__set_bit(EV_ABS, vinput->input->evbit);
 	__set_bit(EV_KEY, vinput->input->evbit);
@@ -242,6 +276,22 @@ static int vinput_vts_mt_init(struct vinput *vinput)
 	return err;
 }
 
+/* export configuration, takes the sysfs attribute names */
+static int vinput_vts_mt_config(struct vinput *vinput, const char *key,
+				const char *val)
+{
+	int i;
+
+	if (strcmp(key, "type") == 0)
+		return vinput_vts_mt_set_type(vinput, val);
+
+	for (i = attr_max_x; i <= attr_max_points; i++)
+		if (strcmp(key, vts_mt_attrs[i].attr.name) == 0)
+			return vinput_vts_mt_set_calib(vinput, i, val);
+
+	return -EINVAL;
+}
+
 static int vinput_vts_mt_kill(struct vinput *vinput)
 {
 	struct vts_mt_data *drvdata = (struct vts_mt_data *)vinput->priv_data;
@@ -250,7 +300,6 @@ static int vinput_vts_mt_kill(struct vinput *vinput)
 	while (attr->attr.name)
 		device_remove_file(&vinput->dev, attr++);
 	kfree(drvdata->slots);
-	kfree(drvdata);
 
 	return 0;
 }
@@ -293,6 +342,10 @@ static int vinput_vts_mt_parse(struct vinput *vinput, char *buff, int len)
 	struct vts_mt_data *drvdata = (struct vts_mt_data *)vinput->priv_data;
 
 	while ((slot = strsep(&buff, ";"))) {
+		/* a trailing ';' or newline is not a slot */
+		if (!*strim(slot))
+			continue;
+
 		ret = sscanf(slot, "%d,%d,%d,%d", &id, &x, &y, &z);
 		if (ret != 4) {
 			dev_warn(&vinput->dev, "Invalid input format\n");
@@ -300,7 +353,6 @@ static int vinput_vts_mt_parse(struct vinput *vinput, char *buff, int len)
 			break;
 		}
 		slot_id = vinput_vts_mt_find_slot(drvdata, id);
-		pr_info("slot=%d\n", slot_id);
 
 		if (slot_id < 0) {
 			dev_warn(&vinput->dev, "No available slots. Max=%d\n", drvdata->max_points);
@@ -308,6 +360,8 @@ static int vinput_vts_mt_parse(struct vinput *vinput, char *buff, int len)
 			break;
 		}
 
+		if (!drvdata->slots[slot_id].updated)
+			drvdata->slots[slot_id].prev_id = drvdata->slots[slot_id].id;
 		if (z == 0)
 			drvdata->slots[slot_id].id = -1;
 		else
@@ -316,7 +370,16 @@ static int vinput_vts_mt_parse(struct vinput *vinput, char *buff, int len)
 		drvdata->slots[slot_id].y = y;
 		drvdata->slots[slot_id].z = z;
 		drvdata->slots[slot_id].updated = 1;
-		pr_info("NEW TOUCH EVT[%d]: id=%d (%d,%d,%d)\n", slot_id, drvdata->slots[slot_id].id, x, y, z);
+		dev_dbg(&vinput->dev, "NEW TOUCH EVT[%d]: id=%d (%d,%d,%d)\n", slot_id, drvdata->slots[slot_id].id, x, y, z);
+	}
+
+	/* nothing is sent from a rejected write, nor are slots taken by it */
+	if (len < 0) {
+		for (slot_id = 0; slot_id < drvdata->max_points; slot_id++) {
+			if (drvdata->slots[slot_id].updated)
+				drvdata->slots[slot_id].id = drvdata->slots[slot_id].prev_id;
+			drvdata->slots[slot_id].updated = 0;
+		}
 	}
 
 	return len;
@@ -340,41 +403,62 @@ static int vinput_vts_mt_send(struct vinput *vinput, char *buff, int len)
 	for (i = 0; i < drvdata->max_points; i++) {
 		if (drvdata->slots[i].updated) {
 			if (drvdata->type == TYPE_B) {
-				input_mt_slot(vinput->input, i);
-				input_report_abs(vinput->input, ABS_MT_TRACKING_ID, drvdata->slots[i].id);
-				input_report_abs(vinput->input, ABS_MT_TOOL_TYPE, MT_TOOL_FINGER);
+				vinput_mt_slot(vinput, i);
+				vinput_report_abs(vinput, ABS_MT_TRACKING_ID, drvdata->slots[i].id);
+				vinput_report_abs(vinput, ABS_MT_TOOL_TYPE, MT_TOOL_FINGER);
 			}
 
-			input_report_abs(vinput->input, ABS_MT_POSITION_X, drvdata->slots[i].x);
-			input_report_abs(vinput->input, ABS_MT_POSITION_Y, drvdata->slots[i].y);
+			vinput_report_abs(vinput, ABS_MT_POSITION_X, drvdata->slots[i].x);
+			vinput_report_abs(vinput, ABS_MT_POSITION_Y, drvdata->slots[i].y);
 			if (drvdata->slots[i].z > 0)
-				input_report_abs(vinput->input, ABS_MT_PRESSURE, drvdata->slots[i].z);
+				vinput_report_abs(vinput, ABS_MT_PRESSURE, drvdata->slots[i].z);
 			else if (drvdata->slots[i].z < 0)
-				input_report_abs(vinput->input, ABS_MT_DISTANCE, -drvdata->slots[i].z);
+				vinput_report_abs(vinput, ABS_MT_DISTANCE, -drvdata->slots[i].z);
 
 			if (drvdata->type == TYPE_A)
-				input_mt_sync(vinput->input);
+				vinput_mt_sync(vinput);
 			drvdata->slots[i].updated = 0;
-			pr_info("SEND TOUCH EVT[%d]: id=%d\n", i, drvdata->slots[i].id);
+			dev_dbg(&vinput->dev, "SEND TOUCH EVT[%d]: id=%d\n", i, drvdata->slots[i].id);
 		}
 	}
 
-	input_mt_report_pointer_emulation(vinput->input, true);
-	input_sync(vinput->input);
+	vinput_mt_report_pointer_emulation(vinput);
+	vinput_sync(vinput);
 
 	return len;
 }
 
+/* binary frames get the same pointer emulation as the text format */
+static void vinput_vts_mt_commit(struct vinput *vinput)
+{
+	vinput_mt_report_pointer_emulation(vinput);
+}
+
+static void vinput_vts_mt_info(struct vinput *vinput, struct vinput_info *info)
+{
+	struct vts_mt_data *drvdata = (struct vts_mt_data *)vinput->priv_data;
+
+	info->max_x = drvdata->max_x;
+	info->max_y = drvdata->max_y;
+	info->max_z = drvdata->max_z;
+	info->max_points = drvdata->max_points;
+}
+
 static struct vinput_ops vts_mt_ops = {
 	.init = vinput_vts_mt_init,
 	.kill = vinput_vts_mt_kill,
 	.send = vinput_vts_mt_send,
 	.read = vinput_vts_mt_read,
+	.config = vinput_vts_mt_config,
+	.commit = vinput_vts_mt_commit,
+	.info = vinput_vts_mt_info,
 };
 
 static struct vinput_device vts_mt_dev = {
 	.name = VINPUT_MTS,
+	.owner = THIS_MODULE,
 	.ops = &vts_mt_ops,
+	.priv_size = sizeof(struct vts_mt_data),
 };
 
 static int __init vts_mt_init(void)